@@ -0,0 +1,26 @@
+#!/bin/bash
+# Run a batch of jobs on the OpenOCD started by daemon.sh, e.g.
+#   ./job.sh identify 'flash fw.hex' 'verify fw.hex' 'provision cal.bin' lock
+# prints one record per job; exits 1 if a job failed, 2 if OpenOCD
+# can't be reached and 3 if the batch didn't run
+port=${EFM32S2_TCL_PORT:-6666}
+
+cmd=efm32s2_batch_report
+for job in "$@"; do
+	cmd="$cmd {$job}"
+done
+
+exec 3<>/dev/tcp/127.0.0.1/$port || exit 2
+printf '%s\032' "$cmd" >&3
+if ! IFS= read -r -d $'\032' reply <&3; then
+	echo "no reply from OpenOCD on port $port" >&2
+	exit 2
+fi
+exec 3<&-
+
+echo "$reply"
+case "${reply##*$'\n'}" in
+"batch ok") exit 0 ;;
+"batch failed") exit 1 ;;
+*) exit 3 ;;
+esac
@@ -46,19 +46,50 @@
 
 #include "imp.h"
 #include <helper/binarybuffer.h>
+#include <helper/fileio.h>
+#include <helper/time_support.h>
+#include <target/image.h>
 #include <target/algorithm.h>
 #include <target/armv7m.h>
 #include <target/cortex_m.h>
+#include <target/register.h>
+#include <jtag/jtag.h>
+#include <jtag/interface.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define EFM_FAMILY_ID_SERIES2V0         128
 
 #define EFM32_FLASH_ERASE_TMO           100
 #define EFM32_FLASH_WDATAREADY_TMO      100
 #define EFM32_FLASH_WRITE_TMO           100
+#define EFM32_FLASH_PAGE_TMO            1000
+/* longest the readback loader may go without sending data */
+#define EFM32_READBACK_TMO              1000
+
+/* largest write loader FIFO, halved until the work area fits it */
+#define EFM32_FIFO_SIZE                 16384
+/* SWD transactions to set up, start and stop a flash algorithm */
+#define EFM32_ALGO_TRANSACTIONS         60
 
 #define EFM32_FLASH_BASE                0
 #define EFM32_FLASH_BASE_G23            0x08000000
 
+#define EFM32_RAM_BASE                  0x20000000
+#define EFM32_SCB_VTOR                  0xe000ed08
+
+/* RAM-run results: the mailbox holds 0 until the image posts a value */
+#define EFM32_RAMRUN_TMO                10000
+#define EFM32_RAMRUN_POLL               10
+
 /* size in bytes, not words; must fit all Gecko devices */
 #define LOCKWORDS_SZ                512
 
@@ -76,8 +107,14 @@
 #define EFM32_MSC_DI_PART_FAMILY        (EFM32_MSC_DEV_INFO+0x004)
 #define EFM32_MSC_DI_LEGACY_FAMILY      (EFM32_MSC_DEV_INFO+0x1fe)
 #define EFM32_MSC_DI_PROD_REV           (EFM32_MSC_DEV_INFO+0x002)
+#define EFM32_MSC_DI_EUI64L             (EFM32_MSC_DEV_INFO+0x048)
+#define EFM32_MSC_DI_EUI64H             (EFM32_MSC_DEV_INFO+0x04c)
+#define EFM32_MSC_DI_HFRCODPLLCAL       (EFM32_MSC_DEV_INFO+0x058)
 
 #define EFM32_MSC_REGBASE               0x40030000
+#define EFM32_MSC_REG_READCTRL          0x004
+#define EFM32_MSC_READCTRL_MODE_MASK    (0x3 << 20)
+#define EFM32_MSC_READCTRL_MODE_WS1     (0x1 << 20)
 #define EFM32_MSC_REG_WRITECTRL         0x00c
 #define EFM32_MSC_WRITECTRL_WREN_MASK   0x1
 #define EFM32_MSC_REG_WRITECMD          0x010
@@ -102,6 +139,50 @@
 #define EFM32_CMU_REG_CLKEN1_MSC_MSK_G22 (1 << 17)
 #define EFM32_CMU_REG_CLKEN1_MSC_MSK_G23 (1 << 16)
 
+#define EFM32_CMU_REG_SYSCLKCTRL        0x070
+#define EFM32_CMU_SYSCLKCTRL_CLKSEL_MASK 0x7
+#define EFM32_CMU_SYSCLKCTRL_CLKSEL_HFRCODPLL 0x2
+#define EFM32_CMU_SYSCLKCTRL_PCLKPRESC_DIV2 (1 << 10)
+
+#define EFM32_HFRCO_REG_CAL             0x008
+#define EFM32_HFRCO_REG_STATUS          0x00c
+#define EFM32_HFRCO_STATUS_FREQBSY_MASK (1 << 16)
+#define EFM32_HFRCO_FREQ_TMO            10
+
+/* PCLK must not exceed 50 MHz, flash reads need a wait state above 40 MHz */
+#define EFM32_PCLK_MAX_MHZ              50
+#define EFM32_FLASH_WS0_MAX_MHZ         40
+
+/* raw MEM-AP register offsets, used before the target is examined */
+#define EFM32_AP_REG_CSW                0x00
+#define EFM32_AP_REG_TAR                0x04
+#define EFM32_AP_REG_DRW                0x0c
+
+#define EFM32_AHB_AP                    0
+#define EFM32_AHB_AP_CSW                0xa2000002
+
+/* Debug Challenge Interface of the Secure Engine */
+#define EFM32_DCI_AP                    1
+#define EFM32_DCI_CSW                   0x22000002
+#define EFM32_DCI_REG_WDATA             0x1000
+#define EFM32_DCI_REG_RDATA             0x1004
+#define EFM32_DCI_REG_STATUS            0x1008
+#define EFM32_DCI_REG_ID                0x10fc
+#define EFM32_DCI_STATUS_WPENDING_MASK  0x1
+#define EFM32_DCI_STATUS_RDATAVALID_MASK 0x100
+#define EFM32_DCI_ID                    0xdc11d
+#define EFM32_DCI_TMO                   1000
+
+#define EFM32_SE_CMD_LEN                8
+#define EFM32_SE_CMD_READ_STATUS        0xfe010000
+#define EFM32_SE_CMD_APPLY_LOCK         0x430c0000
+#define EFM32_SE_STATUS_DEBUGLOCK       0x01
+#define EFM32_SE_STATUS_DEBUGLOCK_HW    0x20
+
+#define EFM32_ATTACH_HALT_TMO           100
+#define EFM32_ATTACH_SRST_HOLD          10
+#define EFM32_ATTACH_RETRIES            3
+
 enum efm32_bank_index {
 	EFM32_BANK_INDEX_MAIN,
 	EFM32_BANK_INDEX_USER_DATA,
@@ -109,6 +190,20 @@ enum efm32_bank_index {
 	EFM32_N_BANKS
 };
 
+/* fastest HFRCODPLL band within the core clock limit of a part family */
+struct efm32_clock_data {
+	uint8_t part_family_num;
+	uint32_t hfrco_regbase;
+	/* index of the band's entry in DEVINFO HFRCODPLLCAL */
+	uint8_t cal_index;
+	uint8_t mhz;
+};
+
+static const struct efm32_clock_data efm32_clocks[] = {
+	{ 22, 0x40010000, 14, 64 },
+	{ 23, 0x40010000, 14, 64 },
+};
+
 static int efm32x_get_bank_index(target_addr_t base)
 {
 	switch (base) {
@@ -150,6 +245,74 @@ struct efm32_info {
 	uint8_t part_family_num;
 	uint8_t prod_rev;
 	uint16_t page_size;
+	/* HFRCODPLL calibration for the fastest band, 0 if unknown */
+	uint32_t boost_cal;
+	const struct efm32_clock_data *clock_data;
+	uint64_t eui64;
+};
+
+enum efm32x_op {
+	EFM32_OP_PROBE,
+	EFM32_OP_PROTECT_CHECK,
+	EFM32_OP_ERASE,
+	EFM32_OP_WRITE,
+	EFM32_OP_WRITE_WORD,
+	EFM32_N_OPS
+};
+
+static const char * const efm32x_op_names[] = {
+	[EFM32_OP_PROBE] = "probe",
+	[EFM32_OP_PROTECT_CHECK] = "protect_check",
+	[EFM32_OP_ERASE] = "erase",
+	[EFM32_OP_WRITE] = "write",
+	[EFM32_OP_WRITE_WORD] = "write_word",
+};
+
+/* totals of one driver operation, nested operations included */
+struct efm32x_op_stats {
+	unsigned int calls;
+	/* pages erased or bytes written */
+	uint64_t units;
+	int64_t total_ms;
+	int64_t max_ms;
+	uint64_t reg_accesses;
+	uint64_t algo_runs;
+};
+
+/* running counters at the start of an operation */
+struct efm32x_stats_mark {
+	int64_t ms;
+	uint64_t reg_accesses;
+	uint64_t algo_runs;
+};
+
+enum efm32x_trace_event {
+	EFM32_TRACE_STATUS,
+	EFM32_TRACE_TIMEOUT,
+	EFM32_TRACE_ERASE,
+	EFM32_TRACE_WRITE,
+	EFM32_TRACE_ADDR_STATUS,
+	EFM32_N_TRACE_EVENTS
+};
+
+/* event names and what their two values hold */
+static const char * const efm32x_trace_formats[][3] = {
+	[EFM32_TRACE_STATUS] = { "status", "STATUS", "wait mask" },
+	[EFM32_TRACE_TIMEOUT] = { "timeout", "STATUS", "wait mask" },
+	[EFM32_TRACE_ERASE] = { "erase", "addr", NULL },
+	[EFM32_TRACE_WRITE] = { "write", "addr", "data" },
+	[EFM32_TRACE_ADDR_STATUS] = { "addr_status", "addr", "STATUS" },
+};
+
+/* number of trace ring entries, a power of two */
+#define EFM32_TRACE_LEN                 512
+/* entries written to the log when an operation fails */
+#define EFM32_TRACE_ERROR_DUMP          16
+
+struct efm32x_trace_entry {
+	int64_t us;
+	uint32_t event;
+	uint32_t value[2];
 };
 
 struct efm32x_flash_chip {
@@ -159,6 +322,43 @@ struct efm32x_flash_chip {
 	uint32_t reg_base;
 	uint32_t reg_lock;
 	uint32_t refcount;
+	bool verify_write;
+	/* write loader variant forced by "efm32s2 loader", NULL for automatic */
+	char *loader_name;
+	bool clock_boost;
+	bool clock_boosted;
+	uint32_t saved_sysclkctrl;
+	uint32_t saved_hfrco_cal;
+	uint32_t saved_readctrl;
+	struct efm32x_bg_job *bg_job;
+	char *bg_event_cmd;
+	Jim_Interp *bg_interp;
+	/* set when the last block write was read back and CRC checked */
+	bool write_verified;
+	/* directory of the page journal, NULL if journaling is off */
+	char *journal_dir;
+	bool erase_free;
+	/* MSC register round trips and flash algorithm runs so far */
+	uint64_t n_reg_accesses;
+	uint64_t n_algo_runs;
+	struct efm32x_op_stats stats[EFM32_N_OPS];
+	/* stats as of the last profile save, which appends only what came since */
+	struct efm32x_op_stats saved[EFM32_N_OPS];
+	/* stats of earlier sessions with this adapter and part */
+	struct efm32x_op_stats profile[EFM32_N_OPS];
+	unsigned int n_profile_records;
+	/* skip block writes, to measure the word by word fallback */
+	bool force_word_write;
+	/* host copy of the flash contents per bank, NULL while off */
+	struct efm32x_cache *cache[EFM32_N_BANKS];
+	/* ring of the last driver events, trace_count is the total so far */
+	struct efm32x_trace_entry trace[EFM32_TRACE_LEN];
+	uint64_t trace_count;
+	/* page manifest location, 0 if off, and the manifest found there,
+	 * read on first use after a probe */
+	uint32_t manifest_loc;
+	bool manifest_loaded;
+	struct efm32x_manifest *manifest;
 };
 
 static const struct efm32_family_data efm32_families[] = {
@@ -225,35 +425,31 @@ static const struct efm32_family_data efm32_families[] = {
 const struct flash_driver efm32s2_flash;
 
 static int efm32x_priv_write(struct flash_bank *bank, const uint8_t *buffer,
-	uint32_t addr, uint32_t count);
+	uint32_t addr, uint32_t count, unsigned int flags);
 
 static int efm32x_write_only_lockbits(struct flash_bank *bank);
 
-static int efm32x_get_flash_size(struct flash_bank *bank, uint16_t *flash_sz)
-{
-	return target_read_u16(bank->target, EFM32_MSC_DI_FLASH_SZ, flash_sz);
-}
+static int efm32x_clock_restore(struct flash_bank *bank);
 
-static int efm32x_get_ram_size(struct flash_bank *bank, uint16_t *ram_sz)
-{
-	return target_read_u16(bank->target, EFM32_MSC_DI_RAM_SZ, ram_sz);
-}
+static void efm32x_bg_free(struct efm32x_flash_chip *efm32x_info);
 
-static int efm32x_get_legacy_family(struct flash_bank *bank, uint8_t *pfamily)
-{
-	return target_read_u8(bank->target, EFM32_MSC_DI_LEGACY_FAMILY, pfamily);
-}
+static bool efm32x_bg_busy(struct flash_bank *bank);
+
+static void efm32x_cache_disable(struct flash_bank *bank);
 
-static int efm32x_get_part_info(struct flash_bank *bank, struct efm32_info *pinfo)
+static int efm32x_manifest_event(struct target *target, enum target_event event,
+	void *priv);
+
+static void efm32x_manifest_free(struct efm32x_flash_chip *efm32x_info);
+
+static void efm32x_manifest_retire(struct flash_bank *bank, uint32_t addr,
+	uint32_t count);
+
+static int efm32x_get_part_info(uint32_t part_info, struct efm32_info *pinfo)
 {
-	int ret;
-	uint32_t part_info;
 	uint8_t fam;
 	uint16_t dev_num;
 
-	ret = target_read_u32(bank->target, EFM32_MSC_DI_PART_FAMILY, &part_info);
-	if (ret != ERROR_OK)
-		return ret;
 	fam = (part_info>>24) & 0x3F;
 	switch (fam) {
 	case 0:
@@ -282,9 +478,54 @@ static int efm32x_get_part_info(struct flash_bank *bank, struct efm32_info *pinf
 	return ERROR_OK;
 }
 
-static int efm32x_get_prod_rev(struct flash_bank *bank, uint8_t *prev)
+static int efm32x_get_clock_info(struct flash_bank *bank, struct efm32_info *pinfo)
+{
+	int ret;
+	uint32_t cal;
+
+	for (size_t i = 0; i < ARRAY_SIZE(efm32_clocks); i++) {
+		if (efm32_clocks[i].part_family_num == pinfo->part_family_num)
+			pinfo->clock_data = &efm32_clocks[i];
+	}
+
+	if (!pinfo->clock_data)
+		return ERROR_OK;
+
+	ret = target_read_u32(bank->target, EFM32_MSC_DI_HFRCODPLLCAL +
+		4 * pinfo->clock_data->cal_index, &cal);
+	if (ret != ERROR_OK)
+		return ret;
+
+	/* blank DEVINFO entries leave the part without boost data */
+	if (cal != 0 && cal != 0xffffffff)
+		pinfo->boost_cal = cal;
+
+	return ERROR_OK;
+}
+
+static void efm32x_stats_begin(struct flash_bank *bank, struct efm32x_stats_mark *mark)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	mark->ms = timeval_ms();
+	mark->reg_accesses = efm32x_info->n_reg_accesses;
+	mark->algo_runs = efm32x_info->n_algo_runs;
+}
+
+static void efm32x_stats_end(struct flash_bank *bank, enum efm32x_op op,
+	const struct efm32x_stats_mark *mark, uint64_t units)
 {
-	return target_read_u8(bank->target, EFM32_MSC_DI_PROD_REV, prev);
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_op_stats *stats = &efm32x_info->stats[op];
+	int64_t ms = timeval_ms() - mark->ms;
+
+	stats->calls++;
+	stats->units += units;
+	stats->total_ms += ms;
+	if (ms > stats->max_ms)
+		stats->max_ms = ms;
+	stats->reg_accesses += efm32x_info->n_reg_accesses - mark->reg_accesses;
+	stats->algo_runs += efm32x_info->n_algo_runs - mark->algo_runs;
 }
 
 static int efm32x_read_reg_u32(struct flash_bank *bank, target_addr_t offset,
@@ -293,6 +534,7 @@ static int efm32x_read_reg_u32(struct flash_bank *bank, target_addr_t offset,
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
 	uint32_t base = efm32x_info->reg_base;
 
+	efm32x_info->n_reg_accesses++;
 	return target_read_u32(bank->target, base + offset, value);
 }
 
@@ -302,9 +544,211 @@ static int efm32x_write_reg_u32(struct flash_bank *bank, target_addr_t offset,
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
 	uint32_t base = efm32x_info->reg_base;
 
+	efm32x_info->n_reg_accesses++;
 	return target_write_u32(bank->target, base + offset, value);
 }
 
+static const char *efm32x_adapter_name(void)
+{
+	return adapter_driver ? adapter_driver->name : "none";
+}
+
+/*
+ * Word accesses queued on the MEM-AP before a DAP run, sized to what the
+ * adapter moves per USB exchange: a word access is a TAR write and a DRW
+ * transfer, 6 request and up to 4 response bytes on CMSIS-DAP, roughly
+ * 50 clocks of MPSSE commands on FTDI.
+ */
+static const struct efm32x_batch_size {
+	const char *adapter;
+	unsigned int accesses;
+} efm32x_batch_sizes[] = {
+	/* four 64 byte HID reports, what the driver keeps in flight */
+	{ "cmsis-dap", 40 },
+	/* the FT232H has 1 KiB of receive FIFO */
+	{ "ftdi", 128 },
+	{ "jlink", 64 },
+};
+
+#define EFM32_BATCH_DEFAULT             16
+
+/*
+ * Register accesses queued and run in as few adapter round trips as the
+ * probe allows, flushed only where a result is needed. Read values are
+ * valid after efm32x_batch_flush(). HLA adapters have no DAP queue, there
+ * each access runs right away.
+ */
+struct efm32x_batch {
+	struct flash_bank *bank;
+	struct adiv5_ap *ap;
+	unsigned int queued;
+	unsigned int size;
+	int ret;
+};
+
+static void efm32x_batch_begin(struct flash_bank *bank, struct efm32x_batch *batch)
+{
+	const char *adapter = efm32x_adapter_name();
+
+	batch->bank = bank;
+	batch->ap = target_to_armv7m(bank->target)->debug_ap;
+	batch->queued = 0;
+	batch->size = EFM32_BATCH_DEFAULT;
+	batch->ret = ERROR_OK;
+	for (size_t i = 0; i < ARRAY_SIZE(efm32x_batch_sizes); i++) {
+		if (!strcmp(adapter, efm32x_batch_sizes[i].adapter))
+			batch->size = efm32x_batch_sizes[i].accesses;
+	}
+}
+
+/*
+ * Run the queued accesses, returns the first error of the batch. The queue
+ * is run even after an error, as queued reads point into the caller's stack.
+ */
+static int efm32x_batch_flush(struct efm32x_batch *batch)
+{
+	if (batch->queued) {
+		int ret = dap_run(batch->ap->dap);
+		if (batch->ret == ERROR_OK)
+			batch->ret = ret;
+	}
+	batch->queued = 0;
+	return batch->ret;
+}
+
+static void efm32x_batch_queued(struct efm32x_batch *batch)
+{
+	if (++batch->queued >= batch->size)
+		efm32x_batch_flush(batch);
+}
+
+static void efm32x_batch_read_u32(struct efm32x_batch *batch, target_addr_t addr,
+	uint32_t *value)
+{
+	if (batch->ret != ERROR_OK)
+		return;
+
+	if (!batch->ap) {
+		batch->ret = target_read_u32(batch->bank->target, addr, value);
+		return;
+	}
+	batch->ret = mem_ap_read_u32(batch->ap, addr, value);
+	if (batch->ret == ERROR_OK)
+		efm32x_batch_queued(batch);
+}
+
+static void efm32x_batch_write_u32(struct efm32x_batch *batch, target_addr_t addr,
+	uint32_t value)
+{
+	if (batch->ret != ERROR_OK)
+		return;
+
+	if (!batch->ap) {
+		batch->ret = target_write_u32(batch->bank->target, addr, value);
+		return;
+	}
+	batch->ret = mem_ap_write_u32(batch->ap, addr, value);
+	if (batch->ret == ERROR_OK)
+		efm32x_batch_queued(batch);
+}
+
+static void efm32x_batch_read_reg(struct efm32x_batch *batch, uint32_t offset,
+	uint32_t *value)
+{
+	struct efm32x_flash_chip *efm32x_info = batch->bank->driver_priv;
+
+	efm32x_info->n_reg_accesses++;
+	efm32x_batch_read_u32(batch, efm32x_info->reg_base + offset, value);
+}
+
+static void efm32x_batch_write_reg(struct efm32x_batch *batch, uint32_t offset,
+	uint32_t value)
+{
+	struct efm32x_flash_chip *efm32x_info = batch->bank->driver_priv;
+
+	efm32x_info->n_reg_accesses++;
+	efm32x_batch_write_u32(batch, efm32x_info->reg_base + offset, value);
+}
+
+/* Record an event in the trace ring, cheap enough for every poll */
+static void efm32x_trace(struct flash_bank *bank, enum efm32x_trace_event event,
+	uint32_t value0, uint32_t value1)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_trace_entry *entry =
+		&efm32x_info->trace[efm32x_info->trace_count++ & (EFM32_TRACE_LEN - 1)];
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	entry->us = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+	entry->event = event;
+	entry->value[0] = value0;
+	entry->value[1] = value1;
+}
+
+/* Decode the last count trace entries, to cmd or to the log if cmd is NULL */
+static void efm32x_trace_dump(struct efm32x_flash_chip *efm32x_info,
+	struct command_invocation *cmd, unsigned int count)
+{
+	uint64_t total = efm32x_info->trace_count;
+	uint64_t held = total < EFM32_TRACE_LEN ? total : EFM32_TRACE_LEN;
+	if (count > held)
+		count = held;
+
+	int64_t prev_us = 0;
+	for (uint64_t i = total - count; i < total; i++) {
+		const struct efm32x_trace_entry *entry =
+			&efm32x_info->trace[i & (EFM32_TRACE_LEN - 1)];
+		const char * const *format = efm32x_trace_formats[entry->event];
+		char line[128];
+
+		int n = snprintf(line, sizeof(line), "%8" PRIu64 " %+9" PRId64 " us  %-12s %s 0x%08" PRIx32,
+			i, i == total - count ? 0 : entry->us - prev_us, format[0], format[1],
+			entry->value[0]);
+		if (format[2] && n > 0 && (size_t)n < sizeof(line))
+			snprintf(line + n, sizeof(line) - n, "  %s 0x%08" PRIx32, format[2],
+				entry->value[1]);
+		prev_us = entry->us;
+
+		if (cmd)
+			command_print(cmd, "%s", line);
+		else
+			LOG_INFO("%s", line);
+	}
+}
+
+static void efm32x_trace_dump_error(struct flash_bank *bank)
+{
+	LOG_INFO("last flash driver events:");
+	efm32x_trace_dump(bank->driver_priv, NULL, EFM32_TRACE_ERROR_DUMP);
+}
+
+/* DEVINFO words the probe decodes, fetched in one batch */
+struct efm32x_devinfo {
+	uint32_t info;		/* PROD_REV in bits 23:16 */
+	uint32_t part;
+	uint32_t meminfo;	/* PAGE_SIZE in bits 7:0 */
+	uint32_t msize;		/* FLASH_SZ in bits 15:0, RAM_SZ in bits 31:16 */
+	uint32_t eui64l;
+	uint32_t eui64h;
+	uint32_t legacy;	/* family in bits 23:16 */
+};
+
+static int efm32x_read_devinfo(struct flash_bank *bank, struct efm32x_devinfo *di)
+{
+	struct efm32x_batch batch;
+
+	efm32x_batch_begin(bank, &batch);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_PROD_REV & ~3, &di->info);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_PART_FAMILY, &di->part);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_PAGE_SIZE, &di->meminfo);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_FLASH_SZ, &di->msize);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_EUI64L, &di->eui64l);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_EUI64H, &di->eui64h);
+	efm32x_batch_read_u32(&batch, EFM32_MSC_DI_LEGACY_FAMILY & ~3, &di->legacy);
+	return efm32x_batch_flush(&batch);
+}
+
 static int efm32x_read_info(struct flash_bank *bank)
 {
 	int ret;
@@ -326,21 +770,15 @@ static int efm32x_read_info(struct flash_bank *bank)
 		return ERROR_FAIL;
 	}
 
-	ret = efm32x_get_flash_size(bank, &(efm32_info->flash_sz_kib));
-	if (ret != ERROR_OK)
-		return ret;
-
-	ret = efm32x_get_ram_size(bank, &(efm32_info->ram_sz_kib));
-	if (ret != ERROR_OK)
-		return ret;
-
-	ret = efm32x_get_legacy_family(bank, &(efm32_info->legacy_family));
+	struct efm32x_devinfo di;
+	ret = efm32x_read_devinfo(bank, &di);
 	if (ret != ERROR_OK)
 		return ret;
 
-	ret = efm32x_get_prod_rev(bank, &(efm32_info->prod_rev));
-	if (ret != ERROR_OK)
-		return ret;
+	efm32_info->flash_sz_kib = di.msize & 0xffff;
+	efm32_info->ram_sz_kib = di.msize >> 16;
+	efm32_info->legacy_family = (di.legacy >> 16) & 0xff;
+	efm32_info->prod_rev = (di.info >> 16) & 0xff;
 
 	for (size_t i = 0; i < ARRAY_SIZE(efm32_families); i++) {
 		if (efm32_families[i].family_id == efm32_info->legacy_family)
@@ -362,9 +800,14 @@ static int efm32x_read_info(struct flash_bank *bank)
 		case 2:
 			efm32x_info->reg_base = EFM32_MSC_REGBASE;
 			efm32x_info->reg_lock = EFM32_MSC_REG_LOCK;
-			ret = efm32x_get_part_info(bank, efm32_info);
+			ret = efm32x_get_part_info(di.part, efm32_info);
 			if (ret != ERROR_OK)
 				return ret;
+			/* the calibration entry depends on the part */
+			ret = efm32x_get_clock_info(bank, efm32_info);
+			if (ret != ERROR_OK)
+				return ret;
+			efm32_info->eui64 = ((uint64_t)di.eui64h << 32) | di.eui64l;
 			break;
 	}
 
@@ -374,11 +817,7 @@ static int efm32x_read_info(struct flash_bank *bank)
 	if (efm32_info->family_data->page_size != 0) {
 		efm32_info->page_size = efm32_info->family_data->page_size;
 	} else {
-		uint8_t pg_size = 0;
-		ret = target_read_u8(bank->target, EFM32_MSC_DI_PAGE_SIZE,
-			&pg_size);
-		if (ret != ERROR_OK)
-			return ret;
+		uint8_t pg_size = di.meminfo & 0xff;
 
 		efm32_info->page_size = (1 << ((pg_size+10) & 0xff));
 
@@ -440,11 +879,17 @@ static void efm32x_free_driver_priv(struct flash_bank *bank)
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
 
 	if (efm32x_info) {
+		efm32x_cache_disable(bank);
+
 		/* Use ref count to determine if it can be freed; scanning bank list doesn't work,
 		 * because this function can be called after some banks in the list have been
 		 * already destroyed */
 		--efm32x_info->refcount;
 		if (efm32x_info->refcount == 0) {
+			efm32x_bg_free(efm32x_info);
+			efm32x_manifest_free(efm32x_info);
+			free(efm32x_info->loader_name);
+			free(efm32x_info->journal_dir);
 			free(efm32x_info);
 			bank->driver_priv = NULL;
 		}
@@ -494,7 +939,7 @@ static int efm32x_wait_status(struct flash_bank *bank, int timeout,
 		if (ret != ERROR_OK)
 			break;
 
-		LOG_DEBUG("status: 0x%" PRIx32 "", status);
+		efm32x_trace(bank, EFM32_TRACE_STATUS, status, wait_mask);
 
 		if (((status & wait_mask) == 0) && (wait_for_set == 0))
 			break;
@@ -502,7 +947,9 @@ static int efm32x_wait_status(struct flash_bank *bank, int timeout,
 			break;
 
 		if (timeout-- <= 0) {
+			efm32x_trace(bank, EFM32_TRACE_TIMEOUT, status, wait_mask);
 			LOG_ERROR("timed out waiting for MSC status");
+			efm32x_trace_dump_error(bank);
 			return ERROR_FAIL;
 		}
 
@@ -515,6 +962,131 @@ static int efm32x_wait_status(struct flash_bank *bank, int timeout,
 	return ret;
 }
 
+static int efm32x_wait_hfrco(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t base = efm32x_info->info.clock_data->hfrco_regbase;
+	uint32_t status = 0;
+	int timeout = EFM32_HFRCO_FREQ_TMO;
+	int ret;
+
+	while (1) {
+		ret = target_read_u32(bank->target, base + EFM32_HFRCO_REG_STATUS, &status);
+		if (ret != ERROR_OK)
+			return ret;
+
+		if (!(status & EFM32_HFRCO_STATUS_FREQBSY_MASK))
+			return ERROR_OK;
+
+		if (timeout-- <= 0) {
+			LOG_ERROR("timed out waiting for HFRCO frequency change");
+			return ERROR_FAIL;
+		}
+
+		alive_sleep(1);
+	}
+}
+
+/**
+ * Switch the core to the fastest HFRCODPLL band of the part before running
+ * flash algorithms, if enabled by "efm32s2 clock_boost".
+ * The original configuration is restored by efm32x_clock_restore().
+ */
+static int efm32x_clock_boost(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct efm32_info *info = &efm32x_info->info;
+	struct target *target = bank->target;
+	int ret;
+
+	if (!efm32x_info->clock_boost || efm32x_info->clock_boosted)
+		return ERROR_OK;
+
+	if (!info->clock_data || !info->boost_cal) {
+		LOG_DEBUG("no clock boost data for this part");
+		return ERROR_OK;
+	}
+
+	uint32_t hfrco = info->clock_data->hfrco_regbase;
+
+	ret = efm32x_read_reg_u32(bank, EFM32_MSC_REG_READCTRL, &efm32x_info->saved_readctrl);
+	if (ret == ERROR_OK)
+		ret = target_read_u32(target, EFM32_CMU_REGBASE + EFM32_CMU_REG_SYSCLKCTRL,
+			&efm32x_info->saved_sysclkctrl);
+	if (ret == ERROR_OK)
+		ret = target_read_u32(target, hfrco + EFM32_HFRCO_REG_CAL,
+			&efm32x_info->saved_hfrco_cal);
+	if (ret != ERROR_OK)
+		return ret;
+
+	/* raise wait states and the PCLK divider before the clock goes up */
+	uint32_t readctrl = efm32x_info->saved_readctrl;
+	if (info->clock_data->mhz > EFM32_FLASH_WS0_MAX_MHZ)
+		readctrl = (readctrl & ~EFM32_MSC_READCTRL_MODE_MASK) | EFM32_MSC_READCTRL_MODE_WS1;
+	ret = efm32x_write_reg_u32(bank, EFM32_MSC_REG_READCTRL, readctrl);
+	if (ret != ERROR_OK)
+		return ret;
+
+	uint32_t sysclkctrl = efm32x_info->saved_sysclkctrl;
+	if (info->clock_data->mhz > EFM32_PCLK_MAX_MHZ)
+		sysclkctrl |= EFM32_CMU_SYSCLKCTRL_PCLKPRESC_DIV2;
+	ret = target_write_u32(target, EFM32_CMU_REGBASE + EFM32_CMU_REG_SYSCLKCTRL, sysclkctrl);
+	if (ret != ERROR_OK)
+		goto restore;
+
+	ret = target_write_u32(target, hfrco + EFM32_HFRCO_REG_CAL, info->boost_cal);
+	if (ret == ERROR_OK)
+		ret = efm32x_wait_hfrco(bank);
+	if (ret != ERROR_OK)
+		goto restore;
+
+	sysclkctrl = (sysclkctrl & ~EFM32_CMU_SYSCLKCTRL_CLKSEL_MASK) |
+		EFM32_CMU_SYSCLKCTRL_CLKSEL_HFRCODPLL;
+	ret = target_write_u32(target, EFM32_CMU_REGBASE + EFM32_CMU_REG_SYSCLKCTRL, sysclkctrl);
+	if (ret != ERROR_OK)
+		goto restore;
+
+	LOG_DEBUG("core clock boosted to %d MHz", info->clock_data->mhz);
+	efm32x_info->clock_boosted = true;
+	return ERROR_OK;
+
+restore:
+	efm32x_info->clock_boosted = true;
+	efm32x_clock_restore(bank);
+	return ret;
+}
+
+static int efm32x_clock_restore(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct target *target = bank->target;
+	int ret, ret2;
+
+	if (!efm32x_info->clock_boosted)
+		return ERROR_OK;
+	efm32x_info->clock_boosted = false;
+
+	uint32_t hfrco = efm32x_info->info.clock_data->hfrco_regbase;
+
+	/* clock down first, wait states last */
+	ret = target_write_u32(target, EFM32_CMU_REGBASE + EFM32_CMU_REG_SYSCLKCTRL,
+		efm32x_info->saved_sysclkctrl);
+	ret2 = target_write_u32(target, hfrco + EFM32_HFRCO_REG_CAL,
+		efm32x_info->saved_hfrco_cal);
+	if (ret2 == ERROR_OK)
+		ret2 = efm32x_wait_hfrco(bank);
+	if (ret == ERROR_OK)
+		ret = ret2;
+	ret2 = efm32x_write_reg_u32(bank, EFM32_MSC_REG_READCTRL, efm32x_info->saved_readctrl);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	if (ret != ERROR_OK)
+		LOG_ERROR("Failed to restore core clock configuration");
+
+	return ret;
+}
+
 static int efm32x_erase_page(struct flash_bank *bank, uint32_t addr)
 {
 	/* this function DOES NOT set WREN; must be set already */
@@ -526,7 +1098,8 @@ static int efm32x_erase_page(struct flash_bank *bank, uint32_t addr)
 	 */
 	int ret = 0;
 	uint32_t status = 0;
-	LOG_DEBUG("erasing flash page at 0x%08" PRIx32, addr);
+	efm32x_manifest_retire(bank, addr, 1);
+	efm32x_trace(bank, EFM32_TRACE_ERASE, addr, 0);
 
 	ret = efm32x_write_reg_u32(bank, EFM32_MSC_REG_ADDRB, addr);
 	if (ret != ERROR_OK)
@@ -541,13 +1114,15 @@ static int efm32x_erase_page(struct flash_bank *bank, uint32_t addr)
 	if (ret != ERROR_OK)
 		return ret;
 
-	LOG_DEBUG("status 0x%" PRIx32, status);
+	efm32x_trace(bank, EFM32_TRACE_ADDR_STATUS, addr, status);
 
 	if (status & EFM32_MSC_STATUS_LOCKED_MASK) {
 		LOG_ERROR("Page is locked");
+		efm32x_trace_dump_error(bank);
 		return ERROR_FAIL;
 	} else if (status & EFM32_MSC_STATUS_INVADDR_MASK) {
 		LOG_ERROR("Invalid address 0x%" PRIx32, addr);
+		efm32x_trace_dump_error(bank);
 		return ERROR_FAIL;
 	}
 
@@ -560,163 +1135,552 @@ static int efm32x_erase_page(struct flash_bank *bank, uint32_t addr)
 		EFM32_MSC_STATUS_BUSY_MASK, 0);
 }
 
-static int efm32x_erase(struct flash_bank *bank, unsigned int first,
-		unsigned int last)
+enum efm32x_cache_state {
+	EFM32_CACHE_INVALID,
+	/* contents kept, but the target ran or was reset since */
+	EFM32_CACHE_STALE,
+	EFM32_CACHE_VALID,
+};
+
+/* host copy of the flash contents of one bank, tracked page by page */
+struct efm32x_cache {
+	struct flash_bank *bank;
+	uint8_t *data;
+	uint8_t *state;
+	unsigned int num_pages;
+	uint32_t page_size;
+	/* pages served from the copy, read over the link, and checksum checked */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t revalidated;
+};
+
+static int efm32x_cache_event(struct target *target, enum target_event event,
+	void *priv)
 {
-	struct target *target = bank->target;
-	int ret = 0;
+	struct efm32x_cache *cache = priv;
 
-	if (target->state != TARGET_HALTED) {
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
-	}
+	if (target != cache->bank->target)
+		return ERROR_OK;
 
-	efm32x_msc_lock(bank, 0);
-	ret = efm32x_set_wren(bank, 1);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to enable MSC write");
-		return ret;
+	switch (event) {
+		case TARGET_EVENT_RESUMED:
+		case TARGET_EVENT_RESET_ASSERT:
+			/* firmware may have changed flash, check each page before use */
+			for (unsigned int i = 0; i < cache->num_pages; i++)
+				if (cache->state[i] == EFM32_CACHE_VALID)
+					cache->state[i] = EFM32_CACHE_STALE;
+			break;
+		default:
+			break;
 	}
 
-	for (unsigned int i = first; i <= last; i++) {
-		ret = efm32x_erase_page(bank, bank->base + bank->sectors[i].offset);
-		if (ret != ERROR_OK)
-			LOG_ERROR("Failed to erase page %d", i);
-	}
+	return ERROR_OK;
+}
 
-	ret = efm32x_set_wren(bank, 0);
-	efm32x_msc_lock(bank, 1);
-	if (ret != ERROR_OK)
-		return ret;
+static void efm32x_cache_disable(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	int bank_index = efm32x_get_bank_index(bank->base);
+	struct efm32x_cache *cache = efm32x_info->cache[bank_index];
 
-	if (bank->base == EFM32_MSC_LOCK_BITS) {
-		ret = efm32x_write_only_lockbits(bank);
-		if (ret != ERROR_OK)
-			LOG_ERROR("Failed to restore lockbits after erase");
-	}
+	if (!cache)
+		return;
 
-	return ret;
+	target_unregister_event_callback(efm32x_cache_event, cache);
+	free(cache->data);
+	free(cache->state);
+	free(cache);
+	efm32x_info->cache[bank_index] = NULL;
 }
 
-static int efm32x_read_lock_data(struct flash_bank *bank)
+static int efm32x_cache_enable(struct flash_bank *bank)
 {
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
-	struct target *target = bank->target;
-	int data_size = 0;
-	uint32_t *ptr = NULL;
-	int ret = 0;
-
-	assert(bank->num_sectors > 0);
+	int bank_index = efm32x_get_bank_index(bank->base);
 
-	/* calculate the number of 32-bit words to read (one lock bit per sector) */
-	data_size = (bank->num_sectors + 31) / 32;
+	if (efm32x_info->cache[bank_index])
+		return ERROR_OK;
 
-	ptr = efm32x_info->lb_page;
+	struct efm32x_cache *cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		LOG_ERROR("no memory for flash cache");
+		return ERROR_FAIL;
+	}
 
-	for (int i = 0; i < data_size; i++, ptr++) {
-		ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+i*4, ptr);
-		if (ret != ERROR_OK) {
-			LOG_ERROR("Failed to read PLW %d", i);
-			return ret;
-		}
+	cache->bank = bank;
+	cache->num_pages = bank->num_sectors;
+	cache->page_size = bank->sectors[0].size;
+	cache->data = malloc(bank->size);
+	cache->state = calloc(cache->num_pages, 1);
+	if (!cache->data || !cache->state) {
+		LOG_ERROR("no memory for flash cache");
+		free(cache->data);
+		free(cache->state);
+		free(cache);
+		return ERROR_FAIL;
 	}
 
-	/* also, read ULW, DLW, MLW, ALW and CLW words */
+	target_register_event_callback(efm32x_cache_event, cache);
+	efm32x_info->cache[bank_index] = cache;
+	return ERROR_OK;
+}
 
-	/* ULW, word 126 */
-	ptr = efm32x_info->lb_page + 126;
-	ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+126*4, ptr);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read ULW");
-		return ret;
+/* mark the caches and page manifest of target stale after a reset the event
+ * callbacks did not see */
+static void efm32x_cache_stale(struct target *target)
+{
+	for (struct flash_bank *bank = flash_bank_list(); bank; bank = bank->next) {
+		if (bank->driver != &efm32s2_flash || bank->target != target || !bank->driver_priv)
+			continue;
+
+		struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+		struct efm32x_cache *cache = efm32x_info->cache[efm32x_get_bank_index(bank->base)];
+		if (cache)
+			efm32x_cache_event(target, TARGET_EVENT_RESET_ASSERT, cache);
+		if (efm32x_info->manifest)
+			efm32x_manifest_event(target, TARGET_EVENT_RESET_ASSERT, efm32x_info->manifest);
 	}
+}
 
-	/* DLW, word 127 */
-	ptr = efm32x_info->lb_page + 127;
-	ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+127*4, ptr);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read DLW");
-		return ret;
+/* cache of the bank holding addr, NULL if there is none */
+static struct efm32x_cache *efm32x_cache_find(struct efm32x_flash_chip *efm32x_info,
+	uint32_t addr)
+{
+	for (int i = 0; i < EFM32_N_BANKS; i++) {
+		struct efm32x_cache *cache = efm32x_info->cache[i];
+		if (cache && addr >= cache->bank->base &&
+				addr - cache->bank->base < cache->num_pages * cache->page_size)
+			return cache;
 	}
+	return NULL;
+}
 
-	/* MLW, word 125, present in GG, LG, PG, JG, EFR32 */
-	ptr = efm32x_info->lb_page + 125;
-	ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+125*4, ptr);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read MLW");
-		return ret;
+/* forget the pages from addr to addr + count */
+static void efm32x_cache_invalidate(struct efm32x_flash_chip *efm32x_info,
+	uint32_t addr, uint32_t count)
+{
+	for (uint32_t a = addr; count > 0 && a - addr < count; ) {
+		struct efm32x_cache *cache = efm32x_cache_find(efm32x_info, a);
+		if (!cache)
+			return;
+		unsigned int page = (a - cache->bank->base) / cache->page_size;
+		cache->state[page] = EFM32_CACHE_INVALID;
+		a = cache->bank->base + (page + 1) * cache->page_size;
 	}
+}
 
-	/* ALW, word 124, present in GG, LG, PG, JG, EFR32 */
-	ptr = efm32x_info->lb_page + 124;
-	ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+124*4, ptr);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read ALW");
-		return ret;
+static void efm32x_cache_erased(struct efm32x_flash_chip *efm32x_info, uint32_t addr)
+{
+	struct efm32x_cache *cache = efm32x_cache_find(efm32x_info, addr);
+	if (!cache)
+		return;
+
+	unsigned int page = (addr - cache->bank->base) / cache->page_size;
+	memset(cache->data + page * cache->page_size, 0xff, cache->page_size);
+	cache->state[page] = EFM32_CACHE_VALID;
+}
+
+/**
+ * Track a successful write of count bytes at addr. Programming only clears
+ * bits, so known pages take the AND of old and new contents; a stale page
+ * stays stale and is checked against the target as usual. With erase set,
+ * pages entered at their start were erased first.
+ */
+static void efm32x_cache_programmed(struct efm32x_flash_chip *efm32x_info,
+	uint32_t addr, const uint8_t *buffer, uint32_t count, bool erase)
+{
+	for (uint32_t i = 0; i < count; ) {
+		struct efm32x_cache *cache = efm32x_cache_find(efm32x_info, addr + i);
+		if (!cache)
+			return;
+
+		uint32_t offset = addr + i - cache->bank->base;
+		unsigned int page = offset / cache->page_size;
+		uint32_t n = (page + 1) * cache->page_size - offset;
+		if (n > count - i)
+			n = count - i;
+
+		if (erase && offset % cache->page_size == 0)
+			efm32x_cache_erased(efm32x_info, addr + i);
+
+		if (cache->state[page] != EFM32_CACHE_INVALID) {
+			uint8_t *data = cache->data + offset;
+			for (uint32_t j = 0; j < n; j++)
+				data[j] &= buffer[i + j];
+		}
+		i += n;
 	}
+}
 
-	/* CLW1, word 123, present in EFR32 */
-	ptr = efm32x_info->lb_page + 123;
-	ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+123*4, ptr);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read CLW1");
+/* Confirm a run of stale pages with one target checksum, page by page on a mismatch */
+static int efm32x_cache_revalidate(struct efm32x_cache *cache, unsigned int first,
+	unsigned int last)
+{
+	uint32_t offset = first * cache->page_size;
+	uint32_t size = (last - first + 1) * cache->page_size;
+	uint32_t target_crc, host_crc;
+
+	int ret = target_checksum_memory(cache->bank->target, cache->bank->base + offset,
+		size, &target_crc);
+	if (ret != ERROR_OK)
+		return ret;
+	ret = image_calculate_checksum(cache->data + offset, size, &host_crc);
+	if (ret != ERROR_OK)
 		return ret;
+
+	if (target_crc == host_crc) {
+		memset(cache->state + first, EFM32_CACHE_VALID, last - first + 1);
+		cache->revalidated += last - first + 1;
+		return ERROR_OK;
 	}
 
-	/* CLW0, word 122, present in GG, LG, PG, JG, EFR32 */
-	ptr = efm32x_info->lb_page + 122;
-	ret = target_read_u32(target, EFM32_MSC_LOCK_BITS+122*4, ptr);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read CLW0");
-		return ret;
+	if (first == last) {
+		cache->state[first] = EFM32_CACHE_INVALID;
+		return ERROR_OK;
 	}
 
+	for (unsigned int page = first; page <= last; page++) {
+		ret = efm32x_cache_revalidate(cache, page, page);
+		if (ret != ERROR_OK)
+			return ret;
+	}
 	return ERROR_OK;
 }
 
-static int efm32x_write_only_lockbits(struct flash_bank *bank)
+/* Make pages first to last valid, reading whatever is not known over the link */
+static int efm32x_cache_fill(struct efm32x_cache *cache, unsigned int first,
+	unsigned int last)
+{
+	unsigned int page, end;
+	int ret;
+
+	for (page = first; page <= last; page = end) {
+		for (end = page; end <= last && cache->state[end] == EFM32_CACHE_STALE; end++)
+			;
+		if (end > page) {
+			ret = efm32x_cache_revalidate(cache, page, end - 1);
+			if (ret != ERROR_OK)
+				return ret;
+		} else {
+			end = page + 1;
+		}
+	}
+
+	for (page = first; page <= last; page = end) {
+		if (cache->state[page] == EFM32_CACHE_VALID) {
+			cache->hits++;
+			end = page + 1;
+			continue;
+		}
+
+		for (end = page; end <= last && cache->state[end] == EFM32_CACHE_INVALID; end++)
+			;
+		uint32_t offset = page * cache->page_size;
+		ret = target_read_buffer(cache->bank->target, cache->bank->base + offset,
+			(end - page) * cache->page_size, cache->data + offset);
+		if (ret != ERROR_OK)
+			return ret;
+		memset(cache->state + page, EFM32_CACHE_VALID, end - page);
+		cache->misses += end - page;
+	}
+
+	return ERROR_OK;
+}
+
+enum efm32x_journal_state {
+	EFM32_JOURNAL_NONE,
+	EFM32_JOURNAL_ERASED,
+	EFM32_JOURNAL_PROGRAMMED,
+	EFM32_JOURNAL_VERIFIED,
+};
+
+/* record tags in the journal file, indexed by state */
+static const char efm32x_journal_tags[] = "-EPV";
+
+/* last journaled state of a page; start, len and crc describe the byte
+ * range programmed into it */
+struct efm32x_journal_page {
+	enum efm32x_journal_state state;
+	uint32_t start;
+	uint32_t len;
+	uint32_t crc;
+};
+
+static char *efm32x_journal_path(struct efm32x_flash_chip *efm32x_info)
+{
+	return alloc_printf("%s/efm32s2-%016" PRIx64 ".journal",
+		efm32x_info->journal_dir, efm32x_info->info.eui64);
+}
+
+/**
+ * Append one page record to the journal of the probed device. Every record
+ * is a line "<tag> <bank base> <page> <start> <len> <crc>"; the last record
+ * of a page wins. The file is closed after each record, so the journal
+ * survives whatever happens to the debug link afterwards.
+ */
+static void efm32x_journal_record(struct flash_bank *bank, unsigned int page,
+	enum efm32x_journal_state state, uint32_t start, uint32_t len, uint32_t crc)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct fileio *fileio;
+	size_t written;
+
+	if (!efm32x_info->journal_dir || !efm32x_info->info.eui64)
+		return;
+
+	char *path = efm32x_journal_path(efm32x_info);
+	char *line = alloc_printf("%c %08" PRIx32 " %u %" PRIu32 " %" PRIu32 " %08" PRIx32 "\n",
+		efm32x_journal_tags[state], (uint32_t)bank->base, page, start, len, crc);
+	if (!path || !line) {
+		LOG_WARNING("no memory for journal record");
+		goto cleanup;
+	}
+
+	if (fileio_open(&fileio, path, FILEIO_APPEND, FILEIO_TEXT) != ERROR_OK) {
+		LOG_WARNING("cannot open journal %s", path);
+		goto cleanup;
+	}
+	if (fileio_write(fileio, strlen(line), line, &written) != ERROR_OK
+			|| written != strlen(line))
+		LOG_WARNING("cannot write journal %s", path);
+	fileio_close(fileio);
+
+cleanup:
+	free(line);
+	free(path);
+}
+
+/* Read the last journaled state of every page of bank; a missing journal
+ * leaves all pages at EFM32_JOURNAL_NONE */
+static int efm32x_journal_load(struct flash_bank *bank,
+	struct efm32x_journal_page *pages)
 {
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
-	return efm32x_priv_write(bank, (uint8_t *)efm32x_info->lb_page, EFM32_MSC_LOCK_BITS, LOCKWORDS_SZ);
+	struct fileio *fileio;
+	char line[80];
+
+	memset(pages, 0, bank->num_sectors * sizeof(*pages));
+
+	char *path = efm32x_journal_path(efm32x_info);
+	if (!path)
+		return ERROR_FAIL;
+
+	int ret = fileio_open(&fileio, path, FILEIO_READ, FILEIO_TEXT);
+	free(path);
+	if (ret != ERROR_OK)
+		return ERROR_OK;
+
+	while (fileio_fgets(fileio, sizeof(line), line) == ERROR_OK) {
+		char tag;
+		uint32_t base, start, len, crc;
+		unsigned int page;
+
+		if (sscanf(line, "%c %" SCNx32 " %u %" SCNu32 " %" SCNu32 " %" SCNx32,
+				&tag, &base, &page, &start, &len, &crc) != 6)
+			continue;
+		const char *state = strchr(efm32x_journal_tags, tag);
+		if (!state || base != bank->base || page >= bank->num_sectors)
+			continue;
+
+		pages[page].state = state - efm32x_journal_tags;
+		pages[page].start = start;
+		pages[page].len = len;
+		pages[page].crc = crc;
+	}
+
+	fileio_close(fileio);
+	return ERROR_OK;
 }
 
-static int efm32x_write_lock_data(struct flash_bank *bank)
+static int efm32x_priv_erase(struct flash_bank *bank, unsigned int first,
+		unsigned int last)
 {
+	struct target *target = bank->target;
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
 	int ret = 0;
 
-	/* Preserve any data written to the high portion of the lockbits page */
-	assert(efm32x_info->info.page_size >= LOCKWORDS_SZ);
-	uint32_t extra_bytes = efm32x_info->info.page_size - LOCKWORDS_SZ;
-	uint8_t *extra_data = NULL;
-	if (extra_bytes) {
-		extra_data = malloc(extra_bytes);
-		ret = target_read_buffer(bank->target, EFM32_MSC_LOCK_BITS_EXTRA, extra_bytes, extra_data);
-		if (ret != ERROR_OK) {
-			LOG_ERROR("Failed to read extra contents of LB page");
-			free(extra_data);
-			return ret;
-		}
+	if (target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
 	}
 
-	ret = efm32x_erase_page(bank, EFM32_MSC_LOCK_BITS);
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	efm32x_msc_lock(bank, 0);
+	ret = efm32x_set_wren(bank, 1);
 	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to erase LB page");
-		if (extra_data)
-			free(extra_data);
+		LOG_ERROR("Failed to enable MSC write");
 		return ret;
 	}
 
-	if (extra_data) {
-		ret = efm32x_priv_write(bank, extra_data, EFM32_MSC_LOCK_BITS_EXTRA, extra_bytes);
-		free(extra_data);
+	for (unsigned int i = first; i <= last; i++) {
+		uint32_t addr = bank->base + bank->sectors[i].offset;
+		ret = efm32x_erase_page(bank, addr);
 		if (ret != ERROR_OK) {
-			LOG_ERROR("Failed to restore extra contents of LB page");
-			return ret;
+			LOG_ERROR("Failed to erase page %d", i);
+			efm32x_cache_invalidate(efm32x_info, addr, bank->sectors[i].size);
+		} else {
+			efm32x_cache_erased(efm32x_info, addr);
+			efm32x_journal_record(bank, i, EFM32_JOURNAL_ERASED, 0,
+				bank->sectors[i].size, 0);
+		}
+	}
+
+	ret = efm32x_set_wren(bank, 0);
+	efm32x_msc_lock(bank, 1);
+	if (ret != ERROR_OK)
+		return ret;
+
+	if (bank->base == EFM32_MSC_LOCK_BITS) {
+		ret = efm32x_write_only_lockbits(bank);
+		if (ret != ERROR_OK)
+			LOG_ERROR("Failed to restore lockbits after erase");
+	}
+
+	return ret;
+}
+
+static int efm32x_erase(struct flash_bank *bank, unsigned int first,
+		unsigned int last)
+{
+	struct efm32x_stats_mark mark;
+
+	efm32x_stats_begin(bank, &mark);
+	int ret = efm32x_priv_erase(bank, first, last);
+	efm32x_stats_end(bank, EFM32_OP_ERASE, &mark, last - first + 1);
+	return ret;
+}
+
+static int efm32x_read_lock_data(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_batch batch;
+	int data_size = 0;
+
+	assert(bank->num_sectors > 0);
+
+	/* calculate the number of 32-bit words to read (one lock bit per sector) */
+	data_size = (bank->num_sectors + 31) / 32;
+
+	efm32x_batch_begin(bank, &batch);
+	for (int i = 0; i < data_size; i++)
+		efm32x_batch_read_u32(&batch, EFM32_MSC_LOCK_BITS + i * 4,
+			&efm32x_info->lb_page[i]);
+
+	/* also, read CLW0, CLW1, ALW, MLW, ULW and DLW, words 122 to 127 */
+	for (int i = 122; i < 128; i++)
+		efm32x_batch_read_u32(&batch, EFM32_MSC_LOCK_BITS + i * 4,
+			&efm32x_info->lb_page[i]);
+
+	int ret = efm32x_batch_flush(&batch);
+	if (ret != ERROR_OK)
+		LOG_ERROR("Failed to read lock bits");
+	return ret;
+}
+
+static int efm32x_write_only_lockbits(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	return efm32x_priv_write(bank, (uint8_t *)efm32x_info->lb_page, EFM32_MSC_LOCK_BITS, LOCKWORDS_SZ, 0);
+}
+
+/*
+ * Bring the flash page at addr to the contents of want with as little work
+ * as possible: nothing if it matches already, only the differing words
+ * programmed in place if they are still erased, else one erase and a write
+ * of everything that isn't erased. No word is programmed twice between
+ * erases. force_erase always erases the page first. n_erases, if not NULL,
+ * counts the erase.
+ */
+static int efm32x_update_page(struct flash_bank *bank, uint32_t addr,
+	uint32_t page_size, const uint8_t *want, bool force_erase, unsigned int *n_erases)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint8_t *have = malloc(page_size);
+	bool in_place = !force_erase;
+	int ret, ret2;
+
+	if (!have) {
+		LOG_ERROR("Out of memory");
+		return ERROR_FAIL;
+	}
+
+	ret = target_read_buffer(bank->target, addr, page_size, have);
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	for (uint32_t i = 0; in_place && i < page_size; i += 4)
+		in_place = !memcmp(have + i, want + i, 4) || le_to_h_u32(have + i) == 0xffffffff;
+
+	if (!in_place) {
+		efm32x_msc_lock(bank, 0);
+		ret = efm32x_set_wren(bank, 1);
+		if (ret == ERROR_OK)
+			ret = efm32x_erase_page(bank, addr);
+		ret2 = efm32x_set_wren(bank, 0);
+		efm32x_msc_lock(bank, 1);
+		if (ret == ERROR_OK)
+			ret = ret2;
+		if (ret != ERROR_OK)
+			goto cleanup;
+
+		efm32x_cache_erased(efm32x_info, addr);
+		memset(have, 0xff, page_size);
+		if (n_erases)
+			(*n_erases)++;
+	}
+
+	/* program each run of differing words */
+	for (uint32_t off = 0; ret == ERROR_OK && off < page_size; ) {
+		if (!memcmp(have + off, want + off, 4)) {
+			off += 4;
+			continue;
 		}
+		uint32_t end = off + 4;
+		while (end < page_size && memcmp(have + end, want + end, 4))
+			end += 4;
+		ret = efm32x_priv_write(bank, want + off, addr + off, end - off, 0);
+		off = end;
+	}
+
+cleanup:
+	free(have);
+	return ret;
+}
+
+/*
+ * Write the lock bits page from lb_page. flash protect passes no n_erases
+ * and gets the page erased and rewritten as it always did; finalize only
+ * erases it if a lock word programmed already has to change.
+ */
+static int efm32x_write_lock_data(struct flash_bank *bank, unsigned int *n_erases)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t page_size = efm32x_info->info.page_size;
+	int ret = 0;
+
+	/* Preserve any data written to the high portion of the lockbits page */
+	assert(page_size >= LOCKWORDS_SZ);
+	uint8_t *page = malloc(page_size);
+	if (!page) {
+		LOG_ERROR("Out of memory");
+		return ERROR_FAIL;
+	}
+
+	ret = target_read_buffer(bank->target, EFM32_MSC_LOCK_BITS_EXTRA,
+		page_size - LOCKWORDS_SZ, page + LOCKWORDS_SZ);
+	if (ret != ERROR_OK) {
+		LOG_ERROR("Failed to read extra contents of LB page");
+		free(page);
+		return ret;
 	}
 
-	return efm32x_write_only_lockbits(bank);
+	memcpy(page, efm32x_info->lb_page, LOCKWORDS_SZ);
+	ret = efm32x_update_page(bank, EFM32_MSC_LOCK_BITS, page_size, page, !n_erases, n_erases);
+	free(page);
+	return ret;
 }
 
 static int efm32x_get_page_lock(struct flash_bank *bank, size_t page)
@@ -748,7 +1712,7 @@ static int efm32x_set_page_lock(struct flash_bank *bank, size_t page, int set)
 {
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
 
-	if (bank->base != EFM32_FLASH_BASE || bank->base != EFM32_FLASH_BASE_G23) {
+	if (bank->base != EFM32_FLASH_BASE && bank->base != EFM32_FLASH_BASE_G23) {
 		LOG_ERROR("Locking user and lockbits pages is not supported yet");
 		return ERROR_FAIL;
 	}
@@ -785,7 +1749,7 @@ static int efm32x_protect(struct flash_bank *bank, int set, unsigned int first,
 		}
 	}
 
-	ret = efm32x_write_lock_data(bank);
+	ret = efm32x_write_lock_data(bank, NULL);
 	if (ret != ERROR_OK) {
 		LOG_ERROR("Failed to write LB page");
 		return ret;
@@ -794,94 +1758,190 @@ static int efm32x_protect(struct flash_bank *bank, int set, unsigned int first,
 	return ERROR_OK;
 }
 
+/* flash write loaders, see contrib/loaders/flash/efm32s2/write.S */
+static const uint8_t efm32x_flash_write_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write.inc"
+};
+
+static const uint8_t efm32x_flash_write_u4_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_u4.inc"
+};
+
+static const uint8_t efm32x_flash_write_crc_u4_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_crc_u4.inc"
+};
+
+static const uint8_t efm32x_flash_write_sg_u4_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_sg_u4.inc"
+};
+
+static const uint8_t efm32x_flash_write_sg_crc_u4_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_sg_crc_u4.inc"
+};
+
+static const uint8_t efm32x_flash_write_erase_u4_4k_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_erase_u4_4k.inc"
+};
+
+static const uint8_t efm32x_flash_write_erase_u4_8k_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_erase_u4_8k.inc"
+};
+
+static const uint8_t efm32x_flash_write_erase_crc_u4_4k_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_erase_crc_u4_4k.inc"
+};
+
+static const uint8_t efm32x_flash_write_erase_crc_u4_8k_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/write_erase_crc_u4_8k.inc"
+};
+
+/* page loader, see contrib/loaders/flash/efm32s2/page.S */
+static const uint8_t efm32x_flash_page_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/page.inc"
+};
+
+/* compressing readback loader, see contrib/loaders/flash/efm32s2/read.S */
+static const uint8_t efm32x_flash_read_code[] = {
+#include "../../../contrib/loaders/flash/efm32s2/read.inc"
+};
+
+/* loader reads back each word and returns a CRC32 and first mismatch */
+#define EFM32_LOADER_CRC                (1 << 0)
+/* loader erases each page before writing its first word */
+#define EFM32_LOADER_ERASE              (1 << 1)
+/* loader reads runs of address, word count and data from its FIFO */
+#define EFM32_LOADER_SCATTER            (1 << 2)
+
+struct efm32x_loader_variant {
+	const char *name;
+	const uint8_t *code;
+	uint32_t code_size;
+	unsigned int flags;
+	/* page size the erase is specialized for, 0 for any */
+	uint32_t page_size;
+};
+
+/* write loaders, fastest first for each set of flags */
+static const struct efm32x_loader_variant efm32x_write_loaders[] = {
+	{ "u4", efm32x_flash_write_u4_code,
+		sizeof(efm32x_flash_write_u4_code), 0, 0 },
+	{ "u1", efm32x_flash_write_code,
+		sizeof(efm32x_flash_write_code), 0, 0 },
+	{ "crc_u4", efm32x_flash_write_crc_u4_code,
+		sizeof(efm32x_flash_write_crc_u4_code), EFM32_LOADER_CRC, 0 },
+	{ "sg_u4", efm32x_flash_write_sg_u4_code,
+		sizeof(efm32x_flash_write_sg_u4_code), EFM32_LOADER_SCATTER, 0 },
+	{ "sg_crc_u4", efm32x_flash_write_sg_crc_u4_code,
+		sizeof(efm32x_flash_write_sg_crc_u4_code),
+		EFM32_LOADER_SCATTER | EFM32_LOADER_CRC, 0 },
+	{ "erase_u4_8k", efm32x_flash_write_erase_u4_8k_code,
+		sizeof(efm32x_flash_write_erase_u4_8k_code), EFM32_LOADER_ERASE, 8192 },
+	{ "erase_u4_4k", efm32x_flash_write_erase_u4_4k_code,
+		sizeof(efm32x_flash_write_erase_u4_4k_code), EFM32_LOADER_ERASE, 4096 },
+	{ "erase_crc_u4_8k", efm32x_flash_write_erase_crc_u4_8k_code,
+		sizeof(efm32x_flash_write_erase_crc_u4_8k_code),
+		EFM32_LOADER_ERASE | EFM32_LOADER_CRC, 8192 },
+	{ "erase_crc_u4_4k", efm32x_flash_write_erase_crc_u4_4k_code,
+		sizeof(efm32x_flash_write_erase_crc_u4_4k_code),
+		EFM32_LOADER_ERASE | EFM32_LOADER_CRC, 4096 },
+};
+
+/**
+ * Pick the write loader for the requested flags, adding CRC if verify while
+ * writing is enabled. Returns NULL if no variant fits the probed part.
+ */
+static const struct efm32x_loader_variant *efm32x_pick_loader(struct flash_bank *bank,
+	unsigned int flags)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct cortex_m_common *cortex_m = target_to_cm(bank->target);
+	uint32_t page_size = bank->num_sectors ? bank->sectors[0].size : 0;
+
+	/* the loaders are Thumb-2 code for the Cortex-M33 of series 2 */
+	if (cortex_m->core_info->partno != CORTEX_M33_PARTNO)
+		return NULL;
+
+	if (efm32x_info->verify_write)
+		flags |= EFM32_LOADER_CRC;
+
+	const struct efm32x_loader_variant *found = NULL;
+	for (size_t i = 0; i < ARRAY_SIZE(efm32x_write_loaders); i++) {
+		const struct efm32x_loader_variant *variant = &efm32x_write_loaders[i];
+
+		if (variant->flags != flags)
+			continue;
+		if (variant->page_size && variant->page_size != page_size)
+			continue;
+		/* a forced variant wins if it fits, otherwise the fastest */
+		if (efm32x_info->loader_name && !strcmp(variant->name, efm32x_info->loader_name))
+			return variant;
+		if (!found)
+			found = variant;
+	}
+
+	return found;
+}
+
+/* CRC32 of the data words of a run stream, in the order the loader reads them back */
+static int efm32x_runs_checksum(const uint8_t *stream, uint32_t count, uint32_t *crc)
+{
+	uint8_t *data = malloc(count * 4);
+	uint32_t n = 0;
+
+	if (!data) {
+		LOG_ERROR("no memory for run checksum");
+		return ERROR_FAIL;
+	}
+
+	for (uint32_t i = 0; i + 2 <= count; ) {
+		uint32_t words = le_to_h_u32(stream + (i + 1) * 4);
+		memcpy(data + n * 4, stream + (i + 2) * 4, words * 4);
+		n += words;
+		i += 2 + words;
+	}
+
+	int ret = image_calculate_checksum(data, n * 4, crc);
+	free(data);
+	return ret;
+}
+
+/**
+ * Stream count words from buf through a write loader. With
+ * EFM32_LOADER_SCATTER, buf is a run stream and count includes the run
+ * headers; address is only the start of the first run.
+ */
 static int efm32x_write_block(struct flash_bank *bank, const uint8_t *buf,
-	uint32_t address, uint32_t count)
+	uint32_t address, uint32_t count, unsigned int flags)
 {
 	struct target *target = bank->target;
-	uint32_t buffer_size = 16384;
+	uint32_t buffer_size = EFM32_FIFO_SIZE;
 	struct working_area *write_algorithm;
 	struct working_area *source;
-	struct reg_param reg_params[5];
+	struct reg_param reg_params[7];
 	struct armv7m_algorithm armv7m_info;
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
 	int ret = ERROR_OK;
 
-	/* see contrib/loaders/flash/efm32.S for src */
-	static const uint8_t efm32x_flash_write_code[] = {
-		/* #define EFM32_MSC_WRITECTRL_OFFSET      0x00c */
-		/* #define EFM32_MSC_WRITECMD_OFFSET       0x010 */
-		/* #define EFM32_MSC_ADDRB_OFFSET          0x014 */
-		/* #define EFM32_MSC_WDATA_OFFSET          0x018 */
-		/* #define EFM32_MSC_STATUS_OFFSET         0x01c */
-
-			0x01, 0x26,    /*       	movs	r6, #1 */
-			0xc6, 0x60,    /*       	str	r6, [r0, #EFM32_MSC_WRITECTRL_OFFSET] */
-
-		/* wait_fifo: */
-			0x16, 0x68,    /*       	ldr	r6, [r2, #0] */
-			0x00, 0x2e,    /*       	cmp	r6, #0 */
-			0x22, 0xd0,    /*       	beq.n	50 <exit> */
-			0x55, 0x68,    /*       	ldr	r5, [r2, #4] */
-			0xb5, 0x42,    /*       	cmp	r5, r6 */
-			0xf9, 0xd0,    /*       	beq.n	4 <wait_fifo> */
-			0x44, 0x61,    /*       	str	r4, [r0, #EFM32_MSC_ADDRB_OFFSET] */
-			0x01, 0x26,    /*       	movs	r6, #1 */
-			0x06, 0x61,    /*       	str	r6, [r0, #EFM32_MSC_WRITECMD_OFFSET] */
-			0xc6, 0x69,    /*       	ldr	r6, [r0, #EFM32_MSC_STATUS_OFFSET] */
-			0x06, 0x27,    /*       	movs	r7, #6 */
-			0x3e, 0x42,    /*       	tst	r6, r7 */
-			0x16, 0xd1,    /*       	bne.n	4c <error> */
-
-		/* wait_wdataready: */
-			0xc6, 0x69,    /*       	ldr	r6, [r0, #EFM32_MSC_STATUS_OFFSET] */
-			0x08, 0x27,    /*       	movs	r7, #8 */
-			0x3e, 0x42,    /*       	tst	r6, r7 */
-			0xfb, 0xd0,    /*       	beq.n	1e <wait_wdataready> */
-			0x2e, 0x68,    /*       	ldr	r6, [r5, #0] */
-			0x86, 0x61,    /*       	str	r6, [r0, #EFM32_MSC_WDATA_OFFSET] */
-			0x08, 0x26,    /*       	movs	r6, #8 */
-			0x06, 0x61,    /*       	str	r6, [r0, #EFM32_MSC_WRITECMD_OFFSET] */
-			0x04, 0x35,    /*       	adds	r5, #4 */
-			0x04, 0x34,    /*       	adds	r4, #4 */
-
-		/* busy: */
-			0xc6, 0x69,    /*       	ldr	r6, [r0, #28] */
-			0x01, 0x27,    /*       	movs	r7, #1 */
-			0x3e, 0x42,    /*       	tst	r6, r7 */
-			0xfb, 0xd1,    /*       	bne.n	32 <busy> */
-			0x9d, 0x42,    /*       	cmp	r5, r3 */
-			0x01, 0xd3,    /*       	bcc.n	42 <no_wrap> */
-			0x15, 0x1c,    /*       	adds	r5, r2, #0 */
-			0x08, 0x35,    /*       	adds	r5, #8 */
-
-		/* no_wrap: */
-			0x55, 0x60,    /*       	str	r5, [r2, #4] */
-			0x01, 0x39,    /*       	subs	r1, #1 */
-			0x00, 0x29,    /*       	cmp	r1, #0 */
-			0x02, 0xd0,    /*       	beq.n	50 <exit> */
-			0xdb, 0xe7,    /*       	b.n	4 <wait_fifo> */
-
-		/* error: */
-			0x00, 0x20,    /*       	movs	r0, #0 */
-			0x50, 0x60,    /*       	str	r0, [r2, #4] */
-
-		/* exit: */
-			0x30, 0x1c,    /*       	adds	r0, r6, #0 */
-			0x00, 0xbe,    /*       	bkpt	0x0000 */
-	};
-
+	const struct efm32x_loader_variant *loader = efm32x_pick_loader(bank, flags);
+	if (!loader) {
+		LOG_WARNING("no write loader for this part, can't do block memory writes");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+	LOG_DEBUG("using write loader %s", loader->name);
 
 	/* flash write code */
-	if (target_alloc_working_area(target, sizeof(efm32x_flash_write_code),
+	if (target_alloc_working_area(target, loader->code_size,
 			&write_algorithm) != ERROR_OK) {
 		LOG_WARNING("no working area available, can't do block memory writes");
 		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
 	}
 
 	ret = target_write_buffer(target, write_algorithm->address,
-			sizeof(efm32x_flash_write_code), efm32x_flash_write_code);
-	if (ret != ERROR_OK)
+			loader->code_size, loader->code);
+	if (ret != ERROR_OK) {
+		target_free_working_area(target, write_algorithm);
 		return ret;
+	}
 
 	/* memory buffer */
 	while (target_alloc_working_area_try(target, buffer_size, &source) != ERROR_OK) {
@@ -902,19 +1962,24 @@ static int efm32x_write_block(struct flash_bank *bank, const uint8_t *buf,
 	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);	/* buffer start */
 	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);	/* buffer end */
 	init_reg_param(&reg_params[4], "r4", 32, PARAM_IN_OUT);	/* target address */
+	init_reg_param(&reg_params[5], "r8", 32, PARAM_IN_OUT);	/* CRC32 of the words read back */
+	init_reg_param(&reg_params[6], "r9", 32, PARAM_IN_OUT);	/* first mismatching address */
 
 	buf_set_u32(reg_params[0].value, 0, 32, efm32x_info->reg_base);
 	buf_set_u32(reg_params[1].value, 0, 32, count);
 	buf_set_u32(reg_params[2].value, 0, 32, source->address);
 	buf_set_u32(reg_params[3].value, 0, 32, source->address + source->size);
 	buf_set_u32(reg_params[4].value, 0, 32, address);
+	buf_set_u32(reg_params[5].value, 0, 32, 0xffffffff);
+	buf_set_u32(reg_params[6].value, 0, 32, 0xffffffff);
 
 	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
 	armv7m_info.core_mode = ARM_MODE_THREAD;
 
+	efm32x_info->n_algo_runs++;
 	ret = target_run_flash_async_algorithm(target, buf, count, 4,
 			0, NULL,
-			5, reg_params,
+			7, reg_params,
 			source->address, source->size,
 			write_algorithm->address, 0,
 			&armv7m_info);
@@ -932,6 +1997,22 @@ static int efm32x_write_block(struct flash_bank *bank, const uint8_t *buf,
 				EFM32_MSC_STATUS_INVADDR_MASK) {
 			LOG_ERROR("invalid flash memory write address");
 		}
+	} else if (ret == ERROR_OK && (loader->flags & EFM32_LOADER_CRC)) {
+		uint32_t crc, mismatch = buf_get_u32(reg_params[6].value, 0, 32);
+
+		if (loader->flags & EFM32_LOADER_SCATTER)
+			ret = efm32x_runs_checksum(buf, count, &crc);
+		else
+			ret = image_calculate_checksum(buf, count * 4, &crc);
+		if (ret == ERROR_OK && mismatch != 0xffffffff) {
+			LOG_ERROR("flash verify failed at address 0x%" PRIx32, mismatch);
+			ret = ERROR_FAIL;
+		} else if (ret == ERROR_OK && crc != buf_get_u32(reg_params[5].value, 0, 32)) {
+			LOG_ERROR("flash CRC mismatch, 0x%08" PRIx32 " expected, 0x%08" PRIx32 " read back",
+				crc, buf_get_u32(reg_params[5].value, 0, 32));
+			ret = ERROR_FAIL;
+		}
+		efm32x_info->write_verified = (ret == ERROR_OK);
 	}
 
 	target_free_working_area(target, source);
@@ -942,6 +2023,8 @@ static int efm32x_write_block(struct flash_bank *bank, const uint8_t *buf,
 	destroy_reg_param(&reg_params[2]);
 	destroy_reg_param(&reg_params[3]);
 	destroy_reg_param(&reg_params[4]);
+	destroy_reg_param(&reg_params[5]);
+	destroy_reg_param(&reg_params[6]);
 
 	return ret;
 }
@@ -957,75 +2040,103 @@ static int efm32x_write_word(struct flash_bank *bank, uint32_t addr,
 	   5. write data to WDATA
 	   6. write WRITECMD_WRITEONCE to WRITECMD
 	   7. wait until !STATUS_BUSY
+	   1-3 and 5-7 each go out in one batch, 4 and 7 poll only if needed
 	 */
 
 	/* FIXME: EFM32G ref states (7.3.2) that writes should be
 	 * performed twice per dword */
 
+	struct efm32x_batch batch;
 	int ret = 0;
 	uint32_t status = 0;
 
 	/* if not called, GDB errors will be reported during large writes */
 	keep_alive();
 
-	ret = efm32x_write_reg_u32(bank, EFM32_MSC_REG_ADDRB, addr);
-	if (ret != ERROR_OK)
-		return ret;
-
-	ret = efm32x_set_reg_bits(bank, EFM32_MSC_REG_WRITECMD,
-		EFM32_MSC_WRITECMD_LADDRIM_MASK, 1);
-	if (ret != ERROR_OK)
-		return ret;
+	efm32x_trace(bank, EFM32_TRACE_WRITE, addr, val);
 
-	ret = efm32x_read_reg_u32(bank, EFM32_MSC_REG_STATUS, &status);
+	efm32x_batch_begin(bank, &batch);
+	efm32x_batch_write_reg(&batch, EFM32_MSC_REG_ADDRB, addr);
+	efm32x_batch_write_reg(&batch, EFM32_MSC_REG_WRITECMD,
+		EFM32_MSC_WRITECMD_LADDRIM_MASK);
+	efm32x_batch_read_reg(&batch, EFM32_MSC_REG_STATUS, &status);
+	ret = efm32x_batch_flush(&batch);
 	if (ret != ERROR_OK)
 		return ret;
 
-	LOG_DEBUG("status 0x%" PRIx32, status);
+	efm32x_trace(bank, EFM32_TRACE_ADDR_STATUS, addr, status);
 
 	if (status & EFM32_MSC_STATUS_LOCKED_MASK) {
 		LOG_ERROR("Page is locked");
+		efm32x_trace_dump_error(bank);
 		return ERROR_FAIL;
 	} else if (status & EFM32_MSC_STATUS_INVADDR_MASK) {
 		LOG_ERROR("Invalid address 0x%" PRIx32, addr);
+		efm32x_trace_dump_error(bank);
 		return ERROR_FAIL;
 	}
 
-	ret = efm32x_wait_status(bank, EFM32_FLASH_WDATAREADY_TMO,
-		EFM32_MSC_STATUS_WDATAREADY_MASK, 1);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Wait for WDATAREADY failed");
-		return ret;
-	}
-
-	ret = efm32x_write_reg_u32(bank, EFM32_MSC_REG_WDATA, val);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("WDATA write failed");
-		return ret;
+	if (!(status & EFM32_MSC_STATUS_WDATAREADY_MASK)) {
+		ret = efm32x_wait_status(bank, EFM32_FLASH_WDATAREADY_TMO,
+			EFM32_MSC_STATUS_WDATAREADY_MASK, 1);
+		if (ret != ERROR_OK) {
+			LOG_ERROR("Wait for WDATAREADY failed");
+			return ret;
+		}
 	}
 
-	ret = efm32x_write_reg_u32(bank, EFM32_MSC_REG_WRITECMD,
+	efm32x_batch_write_reg(&batch, EFM32_MSC_REG_WDATA, val);
+	efm32x_batch_write_reg(&batch, EFM32_MSC_REG_WRITECMD,
 		EFM32_MSC_WRITECMD_WRITEONCE_MASK);
+	efm32x_batch_read_reg(&batch, EFM32_MSC_REG_STATUS, &status);
+	ret = efm32x_batch_flush(&batch);
 	if (ret != ERROR_OK) {
-		LOG_ERROR("WRITECMD write failed");
+		LOG_ERROR("WDATA write failed");
 		return ret;
 	}
 
-	ret = efm32x_wait_status(bank, EFM32_FLASH_WRITE_TMO,
-		EFM32_MSC_STATUS_BUSY_MASK, 0);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Wait for BUSY failed");
-		return ret;
+	/* a word takes a few dozen us, usually done by the time status arrives */
+	efm32x_trace(bank, EFM32_TRACE_STATUS, status, EFM32_MSC_STATUS_BUSY_MASK);
+	if (status & EFM32_MSC_STATUS_BUSY_MASK) {
+		ret = efm32x_wait_status(bank, EFM32_FLASH_WRITE_TMO,
+			EFM32_MSC_STATUS_BUSY_MASK, 0);
+		if (ret != ERROR_OK) {
+			LOG_ERROR("Wait for BUSY failed");
+			return ret;
+		}
 	}
 
 	return ERROR_OK;
 }
 
+/* Erase the page at addr first if flags request it and addr starts a page */
+static int efm32x_write_word_erase(struct flash_bank *bank, uint32_t addr,
+	uint32_t val, unsigned int flags)
+{
+	if ((flags & EFM32_LOADER_ERASE) && !(addr % bank->sectors[0].size)) {
+		int ret = efm32x_erase_page(bank, addr);
+		if (ret != ERROR_OK)
+			return ret;
+	}
+
+	return efm32x_write_word(bank, addr, val);
+}
+
+/**
+ * Program count bytes from buffer to addr. buffer is handed to the loader
+ * FIFO as is; a tail of less than a word is padded with 0xff in a scratch
+ * word and programmed on its own. With EFM32_LOADER_ERASE in flags, every
+ * page is erased as the write enters it at its start.
+ */
 static int efm32x_priv_write(struct flash_bank *bank, const uint8_t *buffer,
-		uint32_t addr, uint32_t count)
+		uint32_t addr, uint32_t count, unsigned int flags)
 {
 	struct target *target = bank->target;
-	uint8_t *new_buffer = NULL;
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t tail = count & 0x3;
+	uint8_t scratch[4];
+
+	efm32x_info->write_verified = false;
 
 	if (target->state != TARGET_HALTED) {
 		LOG_ERROR("Target not halted");
@@ -1038,50 +2149,68 @@ static int efm32x_priv_write(struct flash_bank *bank, const uint8_t *buffer,
 		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
 	}
 
-	if (count & 0x3) {
-		uint32_t old_count = count;
-		count = (old_count | 3) + 1;
-		new_buffer = malloc(count);
-		if (!new_buffer) {
-			LOG_ERROR("odd number of bytes to write and no memory "
-				"for padding buffer");
-			return ERROR_FAIL;
-		}
+	if (tail) {
 		LOG_INFO("odd number of bytes to write (%" PRIu32 "), extending to %" PRIu32 " "
-			"and padding with 0xff", old_count, count);
-		memset(new_buffer, 0xff, count);
-		buffer = memcpy(new_buffer, buffer, old_count);
+			"and padding with 0xff", count, count - tail + 4);
+		memset(scratch, 0xff, sizeof(scratch));
+		memcpy(scratch, buffer + count - tail, tail);
 	}
 
 	uint32_t words_remaining = count / 4;
+	enum efm32x_op op = EFM32_OP_WRITE;
+	struct efm32x_stats_mark mark;
 	int retval, retval2;
 
+	efm32x_stats_begin(bank, &mark);
+
+	retval = efm32x_clock_boost(bank);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
 	/* unlock flash registers */
 	efm32x_msc_lock(bank, 0);
 	retval = efm32x_set_wren(bank, 1);
 	if (retval != ERROR_OK)
-		goto cleanup;
+		goto restore_clock;
+
+	efm32x_manifest_retire(bank, addr, count);
 
 	/* try using a block write */
-	retval = efm32x_write_block(bank, buffer, addr, words_remaining);
+	retval = ERROR_OK;
+	if (efm32x_info->force_word_write)
+		retval = ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	else if (words_remaining > 0)
+		retval = efm32x_write_block(bank, buffer, addr, words_remaining, flags);
 
 	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE) {
 		/* if block write failed (no sufficient working area),
 		 * we use normal (slow) single word accesses */
-		LOG_WARNING("couldn't use block writes, falling back to single "
-			"memory accesses");
-
-		while (words_remaining > 0) {
-			uint32_t value;
-			memcpy(&value, buffer, sizeof(uint32_t));
-
-			retval = efm32x_write_word(bank, addr, value);
+		if (!efm32x_info->force_word_write)
+			LOG_WARNING("couldn't use block writes, falling back to single "
+				"memory accesses");
+
+		op = EFM32_OP_WRITE_WORD;
+		retval = ERROR_OK;
+		for (uint32_t i = 0; i < words_remaining; i++) {
+			retval = efm32x_write_word_erase(bank, addr + i * 4,
+				le_to_h_u32(buffer + i * 4), flags);
 			if (retval != ERROR_OK)
 				goto reset_pg_and_lock;
+		}
+	}
 
-			words_remaining--;
-			buffer += 4;
-			addr += 4;
+	if (retval == ERROR_OK && tail) {
+		uint32_t tail_addr = addr + words_remaining * 4;
+		uint32_t value = le_to_h_u32(scratch);
+
+		retval = efm32x_write_word_erase(bank, tail_addr, value, flags);
+		if (retval == ERROR_OK && efm32x_info->write_verified) {
+			uint32_t readback;
+			retval = target_read_u32(target, tail_addr, &readback);
+			if (retval == ERROR_OK && readback != value) {
+				LOG_ERROR("flash verify failed at address 0x%" PRIx32, tail_addr);
+				retval = ERROR_FAIL;
+			}
 		}
 	}
 
@@ -1091,8 +2220,18 @@ reset_pg_and_lock:
 	if (retval == ERROR_OK)
 		retval = retval2;
 
+restore_clock:
+	retval2 = efm32x_clock_restore(bank);
+	if (retval == ERROR_OK)
+		retval = retval2;
+
 cleanup:
-	free(new_buffer);
+	if (retval == ERROR_OK)
+		efm32x_cache_programmed(efm32x_info, addr, buffer, count,
+			flags & EFM32_LOADER_ERASE);
+	else
+		efm32x_cache_invalidate(efm32x_info, addr, count);
+	efm32x_stats_end(bank, op, &mark, count);
 	return retval;
 }
 
@@ -1103,188 +2242,5378 @@ static int efm32x_write(struct flash_bank *bank, const uint8_t *buffer,
 		LOG_ERROR("Cannot write to lock words");
 		return ERROR_FAIL;
 	}
-	return efm32x_priv_write(bank, buffer, bank->base + offset, count);
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (!efm32x_info->journal_dir)
+		return efm32x_priv_write(bank, buffer, bank->base + offset, count, 0);
+
+	/* journaled writes go page by page, so a dropped link costs one page */
+	while (count > 0) {
+		unsigned int page = offset / bank->sectors[0].size;
+		uint32_t page_offset = bank->sectors[page].offset;
+		uint32_t n = page_offset + bank->sectors[page].size - offset;
+		if (n > count)
+			n = count;
+
+		int ret = efm32x_priv_write(bank, buffer, bank->base + offset, n, 0);
+		if (ret != ERROR_OK)
+			return ret;
+
+		uint32_t crc;
+		ret = image_calculate_checksum(buffer, n, &crc);
+		if (ret != ERROR_OK)
+			return ret;
+		efm32x_journal_record(bank, page, efm32x_info->write_verified ?
+			EFM32_JOURNAL_VERIFIED : EFM32_JOURNAL_PROGRAMMED,
+			offset - page_offset, n, crc);
+
+		buffer += n;
+		offset += n;
+		count -= n;
+	}
+
+	return ERROR_OK;
 }
 
-static int efm32x_probe(struct flash_bank *bank)
+/* one word aligned run of a scatter-gather write */
+struct efm32x_run {
+	uint32_t addr;
+	const uint8_t *data;
+	uint32_t len;
+};
+
+/**
+ * Program n_runs word aligned runs to already erased flash with a single
+ * loader run: the runs are packed into one stream, each behind a header of
+ * its address and word count, and the loader reloads ADDRB at each header.
+ */
+static int efm32x_priv_write_runs(struct flash_bank *bank,
+		const struct efm32x_run *runs, unsigned int n_runs)
 {
+	struct target *target = bank->target;
 	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
-	struct efm32_info *efm32_mcu_info = &(efm32x_info->info);
-	int ret;
-	uint32_t base_address = EFM32_FLASH_BASE;
+	uint32_t words = 0;
 
-	int bank_index = efm32x_get_bank_index(bank->base);
-	assert(bank_index >= 0);
+	efm32x_info->write_verified = false;
 
-	efm32x_info->probed[bank_index] = false;
-	memset(efm32x_info->lb_page, 0xff, LOCKWORDS_SZ);
+	if (target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
 
-	ret = efm32x_read_info(bank);
-	if (ret != ERROR_OK)
-		return ret;
+	for (unsigned int i = 0; i < n_runs; i++) {
+		if ((runs[i].addr | runs[i].len) & 0x3 || runs[i].len == 0) {
+			LOG_ERROR("run at 0x%" PRIx32 " is not word aligned", runs[i].addr);
+			return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+		}
+		words += 2 + runs[i].len / 4;
+	}
 
-	if (efm32_mcu_info->part_family_num == 23) {
-		base_address = EFM32_FLASH_BASE_G23;
+	if (n_runs == 0)
+		return ERROR_OK;
+
+	uint8_t *stream = malloc(words * 4);
+	if (!stream) {
+		LOG_ERROR("no memory for run stream");
+		return ERROR_FAIL;
 	}
 
-	if (bank->base == 0) bank->base = base_address;
+	uint8_t *p = stream;
+	for (unsigned int i = 0; i < n_runs; i++) {
+		h_u32_to_le(p, runs[i].addr);
+		h_u32_to_le(p + 4, runs[i].len / 4);
+		memcpy(p + 8, runs[i].data, runs[i].len);
+		p += 8 + runs[i].len;
+	}
 
-	assert(efm32_mcu_info->page_size != 0);
+	enum efm32x_op op = EFM32_OP_WRITE;
+	struct efm32x_stats_mark mark;
+	int retval, retval2;
 
-	free(bank->sectors);
-	bank->sectors = NULL;
+	efm32x_stats_begin(bank, &mark);
 
-	/* enable MSC clock */
-	uint32_t msc_clken = EFM32_CMU_REG_CLKEN1_MSC_MSK_G22;
-	if (efm32_mcu_info->part_family_num == 22) {
-		msc_clken = EFM32_CMU_REG_CLKEN1_MSC_MSK_G22;
-	} else if (efm32_mcu_info->part_family_num == 23) {
-		msc_clken = EFM32_CMU_REG_CLKEN1_MSC_MSK_G23;
-	} else {
-		LOG_WARNING("Don't know EFR/EFM Gx family number, can't set MSC register. Defaulting to EF{M,R}xG22 values..");
-	}
+	retval = efm32x_clock_boost(bank);
+	if (retval != ERROR_OK)
+		goto cleanup;
 
-	ret = target_write_u32(bank->target, EFM32_CMU_REGBASE + EFM32_CMU_REG_CLKEN1_SET, msc_clken);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to enable MSC clock");
-		return ret;
-	}
+	efm32x_msc_lock(bank, 0);
+	retval = efm32x_set_wren(bank, 1);
+	if (retval != ERROR_OK)
+		goto restore_clock;
 
-	uint16_t page_size;
-	if (bank->base == base_address) {
-		bank->num_sectors = efm32_mcu_info->flash_sz_kib * 1024 /
-			efm32_mcu_info->page_size;
-		assert(bank->num_sectors > 0);
+	for (unsigned int i = 0; i < n_runs; i++)
+		efm32x_manifest_retire(bank, runs[i].addr, runs[i].len);
 
-		ret = efm32x_read_lock_data(bank);
-		if (ret != ERROR_OK) {
-			LOG_ERROR("Failed to read LB data");
-			return ret;
-		}
-		page_size = efm32_mcu_info->page_size;
-	} else{
-		bank->num_sectors = 1;
-		page_size = 1024;
+	if (efm32x_info->force_word_write)
+		retval = ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	else
+		retval = efm32x_write_block(bank, stream, runs[0].addr, words,
+			EFM32_LOADER_SCATTER);
+
+	if (retval == ERROR_TARGET_RESOURCE_NOT_AVAILABLE) {
+		if (!efm32x_info->force_word_write)
+			LOG_WARNING("couldn't use block writes, falling back to single "
+				"memory accesses");
+
+		op = EFM32_OP_WRITE_WORD;
+		retval = ERROR_OK;
+		for (unsigned int i = 0; retval == ERROR_OK && i < n_runs; i++)
+			for (uint32_t j = 0; retval == ERROR_OK && j < runs[i].len; j += 4)
+				retval = efm32x_write_word_erase(bank, runs[i].addr + j,
+					le_to_h_u32(runs[i].data + j), 0);
 	}
-	bank->size = bank->num_sectors * page_size;
 
-	LOG_INFO("detected part: %cG%d%c%03d, rev %d",
-	efm32_mcu_info->part_family,
-	efm32_mcu_info->part_family_num,
-	efm32_mcu_info->dev_num_letter,
-	efm32_mcu_info->dev_num_digits,
-	efm32_mcu_info->prod_rev);
-	LOG_INFO("flash size = %dbytes", bank->size);
-	LOG_INFO("flash page size = %dbytes", page_size);
+	retval2 = efm32x_set_wren(bank, 0);
+	efm32x_msc_lock(bank, 1);
+	if (retval == ERROR_OK)
+		retval = retval2;
 
-	bank->sectors = malloc(sizeof(struct flash_sector) * bank->num_sectors);
-	for (uint32_t i = 0; i < bank->num_sectors; i++) {
-		bank->sectors[i].offset = i * page_size;
-		bank->sectors[i].size = page_size;
-		bank->sectors[i].is_erased = -1;
-		bank->sectors[i].is_protected = 1;
+restore_clock:
+	retval2 = efm32x_clock_restore(bank);
+	if (retval == ERROR_OK)
+		retval = retval2;
+
+cleanup:
+	for (unsigned int i = 0; i < n_runs; i++) {
+		if (retval == ERROR_OK)
+			efm32x_cache_programmed(efm32x_info, runs[i].addr, runs[i].data,
+				runs[i].len, false);
+		else
+			efm32x_cache_invalidate(efm32x_info, runs[i].addr, runs[i].len);
 	}
+	efm32x_stats_end(bank, op, &mark, (words - 2 * n_runs) * 4);
+	free(stream);
+	return retval;
+}
 
-	efm32x_info->probed[bank_index] = true;
+static int efm32x_read(struct flash_bank *bank, uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_cache *cache = efm32x_info->cache[efm32x_get_bank_index(bank->base)];
+
+	/* a running target may change flash under the copy */
+	if (!cache || count == 0 || bank->target->state != TARGET_HALTED)
+		return default_flash_read(bank, buffer, offset, count);
+
+	int ret = efm32x_cache_fill(cache, offset / cache->page_size,
+		(offset + count - 1) / cache->page_size);
+	if (ret != ERROR_OK)
+		return ret;
 
+	memcpy(buffer, cache->data + offset, count);
 	return ERROR_OK;
 }
 
-static int efm32x_auto_probe(struct flash_bank *bank)
-{
-	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+/*
+ * Locate the sectors where flash differs from a buffer by comparing CRCs
+ * over a tree of ranges, from the whole range down to halves and single
+ * sectors. Only mismatching subtrees are descended into, so k bad sectors
+ * cost O(k log n) checksum runs on the target instead of a full read back.
+ */
+struct efm32x_tree_verify {
+	struct flash_bank *bank;
+	const uint8_t *buffer;
+	uint32_t offset, count;
+	unsigned int *bad;
+	unsigned int n_bad;
+	unsigned int n_sums;
+};
 
-	int bank_index = efm32x_get_bank_index(bank->base);
-	assert(bank_index >= 0);
+static int efm32x_tree_verify_node(struct efm32x_tree_verify *tv,
+		unsigned int first, unsigned int last, bool mismatch)
+{
+	if (!mismatch) {
+		/* the part of the sectors the buffer covers */
+		uint32_t start = tv->bank->sectors[first].offset;
+		uint32_t end = tv->bank->sectors[last].offset + tv->bank->sectors[last].size;
+		if (start < tv->offset)
+			start = tv->offset;
+		if (end > tv->offset + tv->count)
+			end = tv->offset + tv->count;
+		uint32_t buf_crc, dev_crc;
+
+		keep_alive();
+		int ret = image_calculate_checksum(tv->buffer + start - tv->offset,
+			end - start, &buf_crc);
+		if (ret == ERROR_OK)
+			ret = target_checksum_memory(tv->bank->target, tv->bank->base + start,
+				end - start, &dev_crc);
+		if (ret != ERROR_OK)
+			return ret;
+		tv->n_sums++;
+		if (buf_crc == dev_crc)
+			return ERROR_OK;
+	}
 
-	if (efm32x_info->probed[bank_index])
+	if (first == last) {
+		tv->bad[tv->n_bad++] = first;
 		return ERROR_OK;
-	return efm32x_probe(bank);
+	}
+
+	unsigned int mid = first + (last - first) / 2;
+	unsigned int n_bad = tv->n_bad;
+	int ret = efm32x_tree_verify_node(tv, first, mid, false);
+	if (ret != ERROR_OK)
+		return ret;
+
+	/* if the lower half matched, the difference is in the upper one */
+	return efm32x_tree_verify_node(tv, mid + 1, last, tv->n_bad == n_bad);
 }
 
-static int efm32x_protect_check(struct flash_bank *bank)
+/* fills bad[] with the differing sectors, it must hold all of the range */
+static int efm32x_tree_verify(struct flash_bank *bank, const uint8_t *buffer,
+		uint32_t offset, uint32_t count, unsigned int *bad,
+		unsigned int *n_bad, unsigned int *n_sums)
 {
-	struct target *target = bank->target;
-	int ret = 0;
+	struct efm32x_tree_verify tv = {
+		.bank = bank,
+		.buffer = buffer,
+		.offset = offset,
+		.count = count,
+		.bad = bad,
+	};
+	unsigned int first = 0, last;
 
-	if (target->state != TARGET_HALTED) {
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+	*n_bad = 0;
+	*n_sums = 0;
+	if (count == 0)
+		return ERROR_OK;
+
+	while (bank->sectors[first].offset + bank->sectors[first].size <= offset)
+		first++;
+	for (last = first; bank->sectors[last].offset + bank->sectors[last].size < offset + count; )
+		last++;
+
+	int ret = efm32x_tree_verify_node(&tv, first, last, false);
+	*n_bad = tv.n_bad;
+	*n_sums = tv.n_sums;
+	return ret;
+}
+
+/* log the sectors behind a failed verify */
+static void efm32x_tree_verify_report(struct flash_bank *bank, const uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	unsigned int *bad = malloc(bank->num_sectors * sizeof(*bad));
+	unsigned int n_bad, n_sums;
+
+	if (!bad)
+		return;
+	if (efm32x_tree_verify(bank, buffer, offset, count, bad, &n_bad, &n_sums) == ERROR_OK) {
+		for (unsigned int i = 0; i < n_bad; i++)
+			LOG_ERROR("flash page %u at " TARGET_ADDR_FMT " differs", bad[i],
+				bank->base + bank->sectors[bad[i]].offset);
 	}
+	free(bad);
+}
 
-	ret = efm32x_read_lock_data(bank);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read LB data");
+static int efm32x_verify(struct flash_bank *bank, const uint8_t *buffer,
+		uint32_t offset, uint32_t count)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_cache *cache = efm32x_info->cache[efm32x_get_bank_index(bank->base)];
+
+	if (!cache || count == 0 || bank->target->state != TARGET_HALTED) {
+		int ret = default_flash_verify(bank, buffer, offset, count);
+		if (ret == ERROR_FAIL && count && bank->target->state == TARGET_HALTED)
+			efm32x_tree_verify_report(bank, buffer, offset, count);
 		return ret;
 	}
 
-	assert(bank->sectors);
+	unsigned int first = offset / cache->page_size;
+	unsigned int last = (offset + count - 1) / cache->page_size;
+	bool known = true;
+	for (unsigned int page = first; page <= last; page++)
+		known &= cache->state[page] != EFM32_CACHE_INVALID;
 
-	for (unsigned int i = 0; i < bank->num_sectors; i++)
-		bank->sectors[i].is_protected = efm32x_get_page_lock(bank, i);
+	int ret;
+	if (known) {
+		ret = efm32x_cache_fill(cache, first, last);
+		if (ret != ERROR_OK)
+			return ret;
+		for (uint32_t i = 0; i < count; i++) {
+			if (buffer[i] != cache->data[offset + i]) {
+				LOG_ERROR("flash at " TARGET_ADDR_FMT " differs: 0x%02" PRIx8
+					" instead of 0x%02" PRIx8, bank->base + offset + i,
+					cache->data[offset + i], buffer[i]);
+				return ERROR_FAIL;
+			}
+		}
+		return ERROR_OK;
+	}
 
+	ret = default_flash_verify(bank, buffer, offset, count);
+	if (ret == ERROR_FAIL)
+		efm32x_tree_verify_report(bank, buffer, offset, count);
+	if (ret != ERROR_OK)
+		return ret;
+
+	/* the target matched buffer, keep the pages it covers entirely */
+	for (unsigned int page = first; page <= last; page++) {
+		uint32_t page_offset = page * cache->page_size;
+		if (page_offset < offset || page_offset + cache->page_size > offset + count)
+			continue;
+		memcpy(cache->data + page_offset, buffer + page_offset - offset, cache->page_size);
+		cache->state[page] = EFM32_CACHE_VALID;
+	}
 	return ERROR_OK;
 }
 
-static int get_efm32x_info(struct flash_bank *bank, struct command_invocation *cmd)
+/*
+ * Page manifest: the CRC32 of each page of the image last programmed,
+ * kept in flash outside of it so the next session knows what the device
+ * holds after one small read. All fields are little endian, followed by
+ * one CRC per page.
+ *
+ * Manifests are records appended to the erased part of an area. Changing
+ * flash a record describes retires it by zeroing its magic word, so a new
+ * record goes behind it without an erase. Only a dedicated manifest page
+ * is erased once full, never the user data page.
+ */
+#define EFM32_MANIFEST_MAGIC            0x4d325345	/* "ES2M" */
+#define EFM32_MANIFEST_HDR_SZ           24
+#define EFM32_MANIFEST_HDR_MAGIC        0x00
+#define EFM32_MANIFEST_HDR_IMAGE_ID     0x04	/* CRC32 of the CRC table */
+#define EFM32_MANIFEST_HDR_BASE         0x08	/* address of the first page */
+#define EFM32_MANIFEST_HDR_PAGE_SIZE    0x0c
+#define EFM32_MANIFEST_HDR_N_PAGES      0x10
+#define EFM32_MANIFEST_HDR_CRC          0x14	/* CRC32 of the fields above */
+#define EFM32_MANIFEST_SZ(n_pages)      (EFM32_MANIFEST_HDR_SZ + (n_pages) * 4)
+/* manifest location meaning the tail of the user data page, where room
+ * is kept for a manifest of the whole bank or as much as fits */
+#define EFM32_MANIFEST_USER_DATA        1
+#define EFM32_USER_DATA_SZ              1024
+#define EFM32_MANIFEST_USER_DATA_PAGES  ((EFM32_USER_DATA_SZ - EFM32_MANIFEST_HDR_SZ) / 4)
+/* pages checksummed on the target before a manifest read back is trusted */
+#define EFM32_MANIFEST_SPOT_CHECKS      3
+
+struct efm32x_manifest {
+	struct flash_bank *bank;
+	/* where it is stored */
+	uint32_t addr;
+	uint32_t image_id;
+	uint32_t base;
+	uint32_t page_size;
+	uint32_t n_pages;
+	/* spot checked since the target last ran */
+	bool checked;
+	uint32_t crc[];
+};
+
+static int efm32x_manifest_event(struct target *target, enum target_event event,
+	void *priv)
 {
-	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
-	int ret;
+	struct efm32x_manifest *manifest = priv;
 
-	ret = efm32x_read_info(bank);
-	if (ret != ERROR_OK) {
-		LOG_ERROR("Failed to read EFM32 info");
-		return ret;
+	if (target != manifest->bank->target)
+		return ERROR_OK;
+
+	switch (event) {
+		case TARGET_EVENT_RESUMED:
+		case TARGET_EVENT_RESET_ASSERT:
+			manifest->checked = false;
+			break;
+		default:
+			break;
 	}
 
-	command_print_sameline(cmd, "%cG%d%c%03d, rev %d", efm32x_info->info.part_family, efm32x_info->info.part_family_num,
-		efm32x_info->info.dev_num_letter, efm32x_info->info.dev_num_digits, efm32x_info->info.prod_rev);
 	return ERROR_OK;
 }
 
-COMMAND_HANDLER(efm32x_handle_debuglock_command)
+static void efm32x_manifest_free(struct efm32x_flash_chip *efm32x_info)
 {
-	struct target *target = NULL;
+	if (!efm32x_info->manifest)
+		return;
 
-	if (CMD_ARGC < 1)
-		return ERROR_COMMAND_SYNTAX_ERROR;
+	target_unregister_event_callback(efm32x_manifest_event, efm32x_info->manifest);
+	free(efm32x_info->manifest);
+	efm32x_info->manifest = NULL;
+}
 
-	struct flash_bank *bank;
-	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
-	if (retval != ERROR_OK)
-		return retval;
+/* efm32s2 bank of the same chip holding addr, NULL if there is none */
+static struct flash_bank *efm32x_bank_by_addr(struct efm32x_flash_chip *efm32x_info,
+	uint32_t addr)
+{
+	for (struct flash_bank *bank = flash_bank_list(); bank; bank = bank->next) {
+		if (bank->driver_priv == efm32x_info && bank->sectors
+				&& addr >= bank->base && addr - bank->base < bank->size)
+			return bank;
+	}
+	return NULL;
+}
 
-	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+/* CRC the manifest holds for the page at addr, false if it doesn't cover it */
+static bool efm32x_manifest_lookup(const struct efm32x_manifest *manifest,
+	uint32_t addr, uint32_t *crc)
+{
+	if (!manifest || addr < manifest->base
+			|| addr - manifest->base >= manifest->n_pages * manifest->page_size)
+		return false;
 
-	target = bank->target;
+	*crc = manifest->crc[(addr - manifest->base) / manifest->page_size];
+	return true;
+}
 
-	if (target->state != TARGET_HALTED) {
-		LOG_ERROR("Target not halted");
-		return ERROR_TARGET_NOT_HALTED;
+/*
+ * Manifest area of the main flash bank: the tail of the user data page, or
+ * the whole flash page at the configured address. area_bank is the bank
+ * holding it, NULL if that isn't probed. False if the manifest is off.
+ */
+static bool efm32x_manifest_area(struct flash_bank *bank, uint32_t *start,
+	uint32_t *end, struct flash_bank **area_bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t loc = efm32x_info->manifest_loc;
+
+	if (!loc)
+		return false;
+
+	if (loc == EFM32_MANIFEST_USER_DATA) {
+		unsigned int n_pages = bank->num_sectors;
+		if (n_pages > EFM32_MANIFEST_USER_DATA_PAGES)
+			n_pages = EFM32_MANIFEST_USER_DATA_PAGES;
+		*end = EFM32_MSC_USER_DATA + EFM32_USER_DATA_SZ;
+		*start = *end - EFM32_MANIFEST_SZ(n_pages);
+		*area_bank = efm32x_bank_by_addr(efm32x_info, EFM32_MSC_USER_DATA);
+		return true;
 	}
 
-	uint32_t *ptr;
-	ptr = efm32x_info->lb_page + 127;
-	*ptr = 0;
-
-	retval = efm32x_write_lock_data(bank);
-	if (retval != ERROR_OK) {
-		LOG_ERROR("Failed to write LB page");
-		return retval;
+	*area_bank = efm32x_bank_by_addr(efm32x_info, loc);
+	if (!*area_bank || (*area_bank)->base != bank->base
+			|| (loc - bank->base) % bank->sectors[0].size) {
+		LOG_WARNING("page manifest location 0x%8.8" PRIx32 " is not a page of its own "
+			"in flash bank %u, ignoring it", loc, bank->bank_number);
+		return false;
 	}
+	*start = loc;
+	*end = loc + bank->sectors[0].size;
+	return true;
+}
 
-	command_print(CMD, "efm32x debug interface locked, reset the device to apply");
+/* start of the manifest area of the main flash bank, 0 if there is none */
+static uint32_t efm32x_manifest_location(struct flash_bank *bank)
+{
+	struct flash_bank *area_bank;
+	uint32_t start, end;
 
-	return ERROR_OK;
+	return efm32x_manifest_area(bank, &start, &end, &area_bank) ? start : 0;
 }
 
-static const struct command_registration efm32x_exec_command_handlers[] = {
-	{
-		.name = "debuglock",
-		.handler = efm32x_handle_debuglock_command,
-		.mode = COMMAND_EXEC,
-		.usage = "bank_id",
-		.help = "Lock the debug interface of the device.",
+/*
+ * Walk the records of a manifest area read back into buf. current is the
+ * offset of the last valid record, UINT32_MAX if there is none, and free
+ * where the erased tail starts, len if a corrupted record ends the walk.
+ */
+static void efm32x_manifest_scan(const uint8_t *buf, uint32_t len,
+	uint32_t *current, uint32_t *free)
+{
+	uint32_t off = 0;
+
+	*current = UINT32_MAX;
+	while (off + EFM32_MANIFEST_HDR_SZ <= len) {
+		uint32_t magic = le_to_h_u32(buf + off + EFM32_MANIFEST_HDR_MAGIC);
+		if (magic == 0xffffffff)
+			break;
+
+		/* a retired record is checked with its magic word as written */
+		uint8_t hdr[EFM32_MANIFEST_HDR_SZ];
+		uint32_t crc;
+		memcpy(hdr, buf + off, sizeof(hdr));
+		h_u32_to_le(hdr + EFM32_MANIFEST_HDR_MAGIC, EFM32_MANIFEST_MAGIC);
+		uint32_t n_pages = le_to_h_u32(hdr + EFM32_MANIFEST_HDR_N_PAGES);
+		if ((magic != EFM32_MANIFEST_MAGIC && magic != 0)
+				|| image_calculate_checksum(hdr, EFM32_MANIFEST_HDR_CRC, &crc) != ERROR_OK
+				|| crc != le_to_h_u32(hdr + EFM32_MANIFEST_HDR_CRC)
+				|| n_pages == 0 || n_pages > (len - off - EFM32_MANIFEST_HDR_SZ) / 4) {
+			off = len;
+			break;
+		}
+
+		if (magic == EFM32_MANIFEST_MAGIC)
+			*current = off;
+		off += EFM32_MANIFEST_SZ(n_pages);
+	}
+	*free = off;
+}
+
+/* Read the manifest of the main flash bank, if there is a valid one */
+static int efm32x_manifest_load(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct flash_bank *area_bank;
+	uint32_t start, end, current, free_off, crc;
+	int ret;
+
+	efm32x_manifest_free(efm32x_info);
+	efm32x_info->manifest_loaded = false;
+	if (!efm32x_manifest_area(bank, &start, &end, &area_bank)) {
+		efm32x_info->manifest_loaded = true;
+		return ERROR_OK;
+	}
+
+	uint8_t *buf = malloc(end - start);
+	if (!buf) {
+		LOG_ERROR("no memory for page manifest");
+		return ERROR_FAIL;
+	}
+
+	ret = target_read_buffer(bank->target, start, end - start, buf);
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	efm32x_info->manifest_loaded = true;
+	efm32x_manifest_scan(buf, end - start, &current, &free_off);
+	if (current == UINT32_MAX) {
+		LOG_DEBUG("no page manifest at 0x%8.8" PRIx32, start);
+		goto cleanup;
+	}
+
+	const uint8_t *hdr = buf + current;
+	uint32_t addr = start + current;
+	uint32_t base = le_to_h_u32(hdr + EFM32_MANIFEST_HDR_BASE);
+	uint32_t page_size = le_to_h_u32(hdr + EFM32_MANIFEST_HDR_PAGE_SIZE);
+	uint32_t n_pages = le_to_h_u32(hdr + EFM32_MANIFEST_HDR_N_PAGES);
+	if (page_size != bank->sectors[0].size || base < bank->base
+			|| base - bank->base >= bank->size || (base - bank->base) % page_size
+			|| n_pages > bank->num_sectors
+			|| n_pages > bank->num_sectors - (base - bank->base) / page_size) {
+		LOG_WARNING("page manifest at 0x%8.8" PRIx32 " doesn't fit flash bank %u, ignoring it",
+			addr, bank->bank_number);
+		goto cleanup;
+	}
+
+	ret = image_calculate_checksum(hdr + EFM32_MANIFEST_HDR_SZ, n_pages * 4, &crc);
+	if (ret != ERROR_OK)
+		goto cleanup;
+	if (crc != le_to_h_u32(hdr + EFM32_MANIFEST_HDR_IMAGE_ID)) {
+		LOG_WARNING("page manifest at 0x%8.8" PRIx32 " is corrupted, ignoring it", addr);
+		goto cleanup;
+	}
+
+	struct efm32x_manifest *manifest = malloc(sizeof(*manifest) + n_pages * 4);
+	if (!manifest) {
+		LOG_ERROR("no memory for page manifest");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+	for (uint32_t i = 0; i < n_pages; i++)
+		manifest->crc[i] = le_to_h_u32(hdr + EFM32_MANIFEST_HDR_SZ + i * 4);
+
+	manifest->bank = bank;
+	manifest->addr = addr;
+	manifest->image_id = crc;
+	manifest->base = base;
+	manifest->page_size = page_size;
+	manifest->n_pages = n_pages;
+	manifest->checked = false;
+
+	target_register_event_callback(efm32x_manifest_event, manifest);
+	efm32x_info->manifest = manifest;
+
+	LOG_INFO("page manifest of image 0x%8.8" PRIx32 ", %" PRIu32 " pages at 0x%8.8" PRIx32,
+		manifest->image_id, n_pages, base);
+
+cleanup:
+	free(buf);
+	return ret;
+}
+
+/* The manifest of the main flash bank, read from flash on first use */
+static struct efm32x_manifest *efm32x_manifest_get(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (!efm32x_info->manifest_loaded && efm32x_manifest_load(bank) != ERROR_OK)
+		LOG_WARNING("failed to read the page manifest");
+	return efm32x_info->manifest;
+}
+
+/* Zero the magic word of a manifest record; MSC write must be on */
+static int efm32x_manifest_zero_magic(struct flash_bank *bank, uint32_t addr)
+{
+	static const uint8_t zero[4];
+
+	int ret = efm32x_write_word(bank, addr, 0);
+	if (ret == ERROR_OK)
+		efm32x_cache_programmed(bank->driver_priv, addr, zero, sizeof(zero), false);
+	return ret;
+}
+
+/* Clear the magic word of the manifest in flash, which needs no erase */
+static int efm32x_manifest_clear(struct flash_bank *bank, uint32_t addr)
+{
+	efm32x_msc_lock(bank, 0);
+	int ret = efm32x_set_wren(bank, 1);
+	if (ret == ERROR_OK)
+		ret = efm32x_manifest_zero_magic(bank, addr);
+	int ret2 = efm32x_set_wren(bank, 0);
+	efm32x_msc_lock(bank, 1);
+	return ret != ERROR_OK ? ret : ret2;
+}
+
+/*
+ * The manifest of the main flash bank, once a few of its pages match their
+ * CRC on the target; one that doesn't is cleared. NULL if there is none,
+ * or it can't be checked while the target runs.
+ */
+static struct efm32x_manifest *efm32x_manifest_check(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_manifest *manifest = efm32x_manifest_get(bank);
+
+	if (!manifest || manifest->checked)
+		return manifest;
+	if (bank->target->state != TARGET_HALTED)
+		return NULL;
+
+	/* the first and last page and one that differs from session to session */
+	uint32_t pages[EFM32_MANIFEST_SPOT_CHECKS] = {
+		0, manifest->n_pages - 1, (uint32_t)timeval_ms() % manifest->n_pages,
+	};
+	for (unsigned int i = 0; i < EFM32_MANIFEST_SPOT_CHECKS; i++) {
+		uint32_t crc;
+		int ret = target_checksum_memory(bank->target,
+			manifest->base + pages[i] * manifest->page_size, manifest->page_size, &crc);
+		if (ret != ERROR_OK)
+			return NULL;
+		if (crc != manifest->crc[pages[i]]) {
+			LOG_INFO("page %" PRIu32 " doesn't match the page manifest, clearing it",
+				pages[i]);
+			if (efm32x_manifest_clear(bank, manifest->addr) != ERROR_OK)
+				LOG_WARNING("failed to clear the page manifest");
+			efm32x_manifest_free(efm32x_info);
+			return NULL;
+		}
+	}
+
+	manifest->checked = true;
+	return manifest;
+}
+
+/* Clear the manifest before flash it describes changes; MSC write must be on */
+static void efm32x_manifest_retire(struct flash_bank *bank, uint32_t addr,
+	uint32_t count)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	/* a manifest not read yet may describe the flash about to change */
+	if (!efm32x_info->manifest_loaded
+			&& efm32x_get_bank_index(bank->base) == EFM32_BANK_INDEX_MAIN)
+		efm32x_manifest_get(bank);
+
+	struct efm32x_manifest *manifest = efm32x_info->manifest;
+	if (!manifest || count == 0 || addr + count <= manifest->base
+			|| addr >= manifest->base + manifest->n_pages * manifest->page_size)
+		return;
+
+	LOG_DEBUG("flash at 0x%8.8" PRIx32 " changes, clearing the page manifest", addr);
+	uint32_t manifest_addr = manifest->addr;
+	efm32x_manifest_free(efm32x_info);
+	if (efm32x_manifest_zero_magic(bank, manifest_addr) != ERROR_OK)
+		LOG_WARNING("failed to clear the page manifest");
+}
+
+/*
+ * Store a manifest of the page CRCs in crc for the n_pages pages from base
+ * of the main flash bank, as a new record in the erased part of the area.
+ * A previous valid record is retired only once the new one is written.
+ * If the user data page has no room left, no manifest is kept.
+ */
+static int efm32x_manifest_write(struct flash_bank *bank, uint32_t base,
+	uint32_t n_pages, const uint32_t *crc)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct flash_bank *area_bank;
+	uint32_t size = EFM32_MANIFEST_SZ(n_pages);
+	uint32_t page_size = bank->sectors[0].size;
+	uint32_t start, end, current, free_off;
+	int ret;
+
+	if (n_pages == 0 || !efm32x_manifest_area(bank, &start, &end, &area_bank))
+		return ERROR_OK;
+
+	if (!area_bank) {
+		LOG_ERROR("page manifest location 0x%8.8" PRIx32 " is not in a probed flash bank",
+			start);
+		return ERROR_FAIL;
+	}
+	if (size > end - start) {
+		LOG_ERROR("page manifest of %" PRIu32 " pages doesn't fit into its area at 0x%8.8"
+			PRIx32, n_pages, start);
+		return ERROR_FAIL;
+	}
+	if (end > base && start < base + n_pages * page_size) {
+		LOG_ERROR("page manifest at 0x%8.8" PRIx32 " is in the pages it describes", start);
+		return ERROR_FAIL;
+	}
+
+	struct efm32x_manifest *manifest = malloc(sizeof(*manifest) + n_pages * 4);
+	uint8_t *buf = malloc(end - start);
+	uint8_t *out = malloc(size);
+	if (!manifest || !buf || !out) {
+		LOG_ERROR("no memory for page manifest");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	for (uint32_t i = 0; i < n_pages; i++)
+		h_u32_to_le(out + EFM32_MANIFEST_HDR_SZ + i * 4, crc[i]);
+	ret = image_calculate_checksum(out + EFM32_MANIFEST_HDR_SZ, n_pages * 4,
+		&manifest->image_id);
+	h_u32_to_le(out + EFM32_MANIFEST_HDR_MAGIC, EFM32_MANIFEST_MAGIC);
+	h_u32_to_le(out + EFM32_MANIFEST_HDR_IMAGE_ID, manifest->image_id);
+	h_u32_to_le(out + EFM32_MANIFEST_HDR_BASE, base);
+	h_u32_to_le(out + EFM32_MANIFEST_HDR_PAGE_SIZE, page_size);
+	h_u32_to_le(out + EFM32_MANIFEST_HDR_N_PAGES, n_pages);
+	uint32_t hdr_crc = 0;
+	if (ret == ERROR_OK)
+		ret = image_calculate_checksum(out, EFM32_MANIFEST_HDR_CRC, &hdr_crc);
+	h_u32_to_le(out + EFM32_MANIFEST_HDR_CRC, hdr_crc);
+	if (ret == ERROR_OK)
+		ret = target_read_buffer(bank->target, start, end - start, buf);
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	efm32x_manifest_scan(buf, end - start, &current, &free_off);
+	uint32_t addr = start + free_off;
+	bool room = free_off <= end - start && size <= end - start - free_off;
+	for (uint32_t i = 0; room && i < size; i++)
+		room = buf[free_off + i] == 0xff;
+
+	if (current != UINT32_MAX && !memcmp(buf + current, out, size)) {
+		/* already up to date */
+		addr = start + current;
+		current = UINT32_MAX;
+	} else if (room) {
+		ret = efm32x_priv_write(area_bank, out, addr, size, 0);
+	} else if (efm32x_info->manifest_loc != EFM32_MANIFEST_USER_DATA) {
+		/* a page of its own, holding nothing but manifests */
+		unsigned int sector = (start - area_bank->base) / area_bank->sectors[0].size;
+		addr = start;
+		current = UINT32_MAX;
+		ret = efm32x_priv_erase(area_bank, sector, sector);
+		if (ret == ERROR_OK)
+			ret = efm32x_priv_write(area_bank, out, addr, size, 0);
+	} else {
+		LOG_WARNING("no erased room left for a page manifest in the user data page, "
+			"none is kept until its tail at 0x%8.8" PRIx32 " is erased", start);
+		efm32x_manifest_free(efm32x_info);
+		if (current != UINT32_MAX && efm32x_manifest_clear(area_bank, start + current) != ERROR_OK)
+			LOG_WARNING("failed to retire the previous page manifest");
+		goto cleanup;
+	}
+
+	/* the new record is in place, the old one goes */
+	if (ret == ERROR_OK && current != UINT32_MAX
+			&& efm32x_manifest_clear(area_bank, start + current) != ERROR_OK)
+		LOG_WARNING("failed to retire the previous page manifest");
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	efm32x_manifest_free(efm32x_info);
+	efm32x_info->manifest_loaded = true;
+	manifest->bank = bank;
+	manifest->addr = addr;
+	manifest->base = base;
+	manifest->page_size = page_size;
+	manifest->n_pages = n_pages;
+	manifest->checked = true;
+	memcpy(manifest->crc, crc, n_pages * 4);
+	target_register_event_callback(efm32x_manifest_event, manifest);
+	efm32x_info->manifest = manifest;
+	manifest = NULL;
+
+	LOG_INFO("page manifest of image 0x%8.8" PRIx32 " written to 0x%8.8" PRIx32,
+		efm32x_info->manifest->image_id, addr);
+
+cleanup:
+	free(out);
+	free(buf);
+	free(manifest);
+	return ret;
+}
+
+/* Page loader op stream: each op word holds the op type in its upper and
+ * the number of words it covers in its lower half-word. */
+#define EFM32_PAGE_OP(type, n_words)    (((type) << 16) | (n_words))
+#define EFM32_PAGE_OP_END               0
+#define EFM32_PAGE_OP_LIT               1	/* n literal words follow */
+#define EFM32_PAGE_OP_FILL              2	/* one word follows, repeated n times */
+#define EFM32_PAGE_OP_SKIP              3	/* keep n words of the current page */
+
+/* room for the worst case of efm32x_page_encode() */
+#define EFM32_PAGE_OPS_SZ(page_size)    ((page_size) + 16)
+
+struct efm32x_page_loader {
+	struct working_area *code;
+	/* page buffer, followed by the op stream */
+	struct working_area *buf;
+	uint32_t page_size;
+	/* program pages in place if that only clears bits */
+	bool erase_free;
+	/* pages programmed without an erase */
+	unsigned int n_in_place;
+};
+
+static uint32_t efm32x_page_emit(uint8_t *ops, uint32_t len, uint32_t word)
+{
+	h_u32_to_le(ops + len, word);
+	return len + 4;
+}
+
+/* Emit the words [start, end) of data as a mix of LIT and FILL ops */
+static uint32_t efm32x_page_emit_run(uint8_t *ops, uint32_t len,
+	const uint8_t *data, uint32_t start, uint32_t end)
+{
+	uint32_t i = start;
+
+	while (i < end) {
+		uint32_t value = le_to_h_u32(data + i * 4);
+		uint32_t rep = 1;
+		while (i + rep < end && le_to_h_u32(data + (i + rep) * 4) == value)
+			rep++;
+
+		if (rep >= 3) {
+			len = efm32x_page_emit(ops, len, EFM32_PAGE_OP(EFM32_PAGE_OP_FILL, rep));
+			len = efm32x_page_emit(ops, len, value);
+			i += rep;
+			continue;
+		}
+
+		/* literal words up to the next run of three equal words */
+		uint32_t lit_end = i + rep;
+		while (lit_end < end) {
+			uint32_t v = le_to_h_u32(data + lit_end * 4);
+			if (lit_end + 2 < end && le_to_h_u32(data + (lit_end + 1) * 4) == v
+					&& le_to_h_u32(data + (lit_end + 2) * 4) == v)
+				break;
+			lit_end++;
+		}
+
+		len = efm32x_page_emit(ops, len, EFM32_PAGE_OP(EFM32_PAGE_OP_LIT, lit_end - i));
+		for (; i < lit_end; i++)
+			len = efm32x_page_emit(ops, len, le_to_h_u32(data + i * 4));
+	}
+
+	return len;
+}
+
+static bool efm32x_page_word_differs(const uint8_t *data, const uint8_t *ref,
+	uint32_t i)
+{
+	return !ref || le_to_h_u32(data + i * 4) != le_to_h_u32(ref + i * 4);
+}
+
+/**
+ * Encode the page loader op stream that turns the current contents of a page
+ * into new ones. data holds n_words new words starting at page word first,
+ * ref the words currently in flash at the same place, or NULL if unknown.
+ * Words outside the range keep their current contents.
+ * ops must provide 2 * page size + 16 bytes of scratch space; the result
+ * never exceeds EFM32_PAGE_OPS_SZ(page size).
+ * Returns the stream length in bytes, or 0 if the page is unchanged.
+ */
+static uint32_t efm32x_page_encode(uint8_t *ops, const uint8_t *data,
+	const uint8_t *ref, uint32_t first, uint32_t n_words)
+{
+	uint32_t len = 0;
+	uint32_t cursor = 0;
+	uint32_t i = 0;
+
+	while (i < n_words) {
+		if (!efm32x_page_word_differs(data, ref, i)) {
+			i++;
+			continue;
+		}
+
+		/* collect differing words, absorbing gaps too short for a SKIP op */
+		uint32_t end = i + 1;
+		while (end < n_words) {
+			uint32_t gap = 0;
+			while (end + gap < n_words && gap <= 2
+					&& !efm32x_page_word_differs(data, ref, end + gap))
+				gap++;
+			if (gap > 2 || end + gap == n_words)
+				break;
+			end += gap + 1;
+		}
+
+		if (first + i > cursor)
+			len = efm32x_page_emit(ops, len,
+				EFM32_PAGE_OP(EFM32_PAGE_OP_SKIP, first + i - cursor));
+		len = efm32x_page_emit_run(ops, len, data, i, end);
+		cursor = first + end;
+		i = end;
+	}
+
+	if (len == 0)
+		return 0;
+
+	if (len + 4 > EFM32_PAGE_OPS_SZ(n_words * 4) - 8) {
+		/* fragmented beyond the size of the plain data, send it all */
+		len = 0;
+		if (first)
+			len = efm32x_page_emit(ops, len, EFM32_PAGE_OP(EFM32_PAGE_OP_SKIP, first));
+		len = efm32x_page_emit(ops, len, EFM32_PAGE_OP(EFM32_PAGE_OP_LIT, n_words));
+		memcpy(ops + len, data, n_words * 4);
+		len += n_words * 4;
+	}
+
+	return efm32x_page_emit(ops, len, EFM32_PAGE_OP(EFM32_PAGE_OP_END, 0));
+}
+
+/*
+ * Check an op stream not built by efm32x_page_encode() before the loader
+ * runs it: no op may reach past the n_words of a page and the stream must
+ * end with its END op.
+ */
+static bool efm32x_page_ops_valid(const uint8_t *ops, uint32_t len, uint32_t n_words)
+{
+	uint32_t i = 0, n = 0;
+
+	while (len - i >= 4) {
+		uint32_t op = le_to_h_u32(ops + i);
+		uint32_t count = op & 0xffff;
+
+		if (count > n_words - n)
+			return false;
+		switch (op >> 16) {
+		case EFM32_PAGE_OP_END:
+			return i + 4 == len;
+		case EFM32_PAGE_OP_LIT:
+			if (len - i - 4 < count * 4)
+				return false;
+			i += 4 + count * 4;
+			break;
+		case EFM32_PAGE_OP_FILL:
+			if (len - i < 8)
+				return false;
+			i += 8;
+			break;
+		case EFM32_PAGE_OP_SKIP:
+			i += 4;
+			break;
+		default:
+			return false;
+		}
+		n += count;
+	}
+
+	return false;
+}
+
+static int efm32x_page_loader_init(struct flash_bank *bank,
+	struct efm32x_page_loader *loader, uint32_t page_size)
+{
+	struct target *target = bank->target;
+	int ret;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	memset(loader, 0, sizeof(*loader));
+	loader->page_size = page_size;
+	loader->erase_free = efm32x_info->erase_free;
+
+	if (target_alloc_working_area(target, sizeof(efm32x_flash_page_code),
+			&loader->code) != ERROR_OK) {
+		LOG_WARNING("no working area available, can't run page loader");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	ret = target_write_buffer(target, loader->code->address,
+			sizeof(efm32x_flash_page_code), efm32x_flash_page_code);
+	if (ret != ERROR_OK) {
+		target_free_working_area(target, loader->code);
+		return ret;
+	}
+
+	if (target_alloc_working_area(target, page_size + EFM32_PAGE_OPS_SZ(page_size),
+			&loader->buf) != ERROR_OK) {
+		target_free_working_area(target, loader->code);
+		LOG_WARNING("page loader needs %" PRIu32 " bytes of working area",
+			(uint32_t)sizeof(efm32x_flash_page_code) + page_size +
+			EFM32_PAGE_OPS_SZ(page_size));
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	return ERROR_OK;
+}
+
+static void efm32x_page_loader_free(struct flash_bank *bank,
+	struct efm32x_page_loader *loader)
+{
+	target_free_working_area(bank->target, loader->buf);
+	target_free_working_area(bank->target, loader->code);
+}
+
+/* Rebuild the page at addr from its current contents and the op stream */
+static int efm32x_page_loader_run(struct flash_bank *bank,
+	struct efm32x_page_loader *loader, uint32_t addr,
+	const uint8_t *ops, uint32_t ops_len)
+{
+	struct target *target = bank->target;
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct reg_param reg_params[6];
+	struct armv7m_algorithm armv7m_info;
+	uint32_t ops_addr = loader->buf->address + loader->page_size;
+	int ret;
+
+	efm32x_manifest_retire(bank, addr, loader->page_size);
+
+	ret = target_write_buffer(target, ops_addr, ops_len, ops);
+	if (ret != ERROR_OK)
+		return ret;
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);	/* flash base (in), status (out) */
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_IN_OUT);	/* page address (in), failing address (out) */
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);	/* op stream */
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);	/* page buffer */
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);	/* page size */
+	init_reg_param(&reg_params[5], "r8", 32, PARAM_IN_OUT);	/* in place allowed (in), erased (out) */
+
+	buf_set_u32(reg_params[0].value, 0, 32, efm32x_info->reg_base);
+	buf_set_u32(reg_params[1].value, 0, 32, addr);
+	buf_set_u32(reg_params[2].value, 0, 32, ops_addr);
+	buf_set_u32(reg_params[3].value, 0, 32, loader->buf->address);
+	buf_set_u32(reg_params[4].value, 0, 32, loader->page_size);
+	buf_set_u32(reg_params[5].value, 0, 32, loader->erase_free);
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARM_MODE_THREAD;
+
+	efm32x_info->n_algo_runs++;
+	ret = target_run_algorithm(target, 0, NULL, 6, reg_params,
+			loader->code->address, 0, EFM32_FLASH_PAGE_TMO, &armv7m_info);
+	efm32x_cache_invalidate(efm32x_info, addr, loader->page_size);
+
+	if (ret == ERROR_OK) {
+		uint32_t status = buf_get_u32(reg_params[0].value, 0, 32);
+		if (status) {
+			LOG_ERROR("page program failed at address 0x%" PRIx32 ", status 0x%" PRIx32,
+				buf_get_u32(reg_params[1].value, 0, 32), status);
+			if (status & EFM32_MSC_STATUS_LOCKED_MASK)
+				LOG_ERROR("flash memory write protected");
+			if (status & EFM32_MSC_STATUS_INVADDR_MASK)
+				LOG_ERROR("invalid flash memory write address");
+			if (status & EFM32_MSC_STATUS_ERASEABORTED_MASK)
+				LOG_ERROR("page erase was aborted");
+			ret = ERROR_FLASH_OPERATION_FAILED;
+		} else if (!buf_get_u32(reg_params[5].value, 0, 32)) {
+			LOG_DEBUG("page at 0x%" PRIx32 " programmed in place", addr);
+			loader->n_in_place++;
+		}
+	}
+
+	for (int i = 0; i < 6; i++)
+		destroy_reg_param(&reg_params[i]);
+
+	return ret;
+}
+
+/* pages encoded ahead of the one being programmed */
+#define EFM32_PIPELINE_DEPTH            4
+/* how long the main thread waits for the worker to encode an item, in ms */
+#define EFM32_PIPELINE_TMO              5000
+
+/* Encode item i into ops; returns the stream length, 0 if there's nothing to send */
+typedef uint32_t (*efm32x_pipeline_fn)(void *priv, uint32_t i, uint8_t *ops);
+
+struct efm32x_pipeline_slot {
+	uint8_t *ops;
+	uint32_t len;
+};
+
+/*
+ * Page op streams prepared by a worker thread while the main thread programs
+ * the previous ones. The slots form a single producer, single consumer ring:
+ * head is only written by the worker, tail only by the main thread, which
+ * takes every item in order with efm32x_pipeline_next() and hands it back
+ * with efm32x_pipeline_done(). The encode function must not call into
+ * OpenOCD, which isn't thread safe.
+ */
+struct efm32x_pipeline {
+	efm32x_pipeline_fn encode;
+	void *priv;
+	uint32_t n_items;
+	struct efm32x_pipeline_slot slot[EFM32_PIPELINE_DEPTH];
+	/* items encoded, items programmed, and set to stop the worker early */
+	uint32_t head;
+	uint32_t tail;
+	uint32_t cancel;
+	/* set by the worker when it returns */
+	uint32_t exited;
+	/* false if no thread could be started, the main thread encodes then */
+	bool threaded;
+#ifdef _WIN32
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
+};
+
+static void efm32x_pipeline_pause(void)
+{
+#ifdef _WIN32
+	Sleep(0);
+#else
+	usleep(50);
+#endif
+}
+
+static void efm32x_pipeline_work(struct efm32x_pipeline *pl)
+{
+	for (uint32_t i = 0; i < pl->n_items; i++) {
+		/* wait for the main thread to free a slot */
+		while (i >= __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE) + EFM32_PIPELINE_DEPTH) {
+			if (__atomic_load_n(&pl->cancel, __ATOMIC_RELAXED))
+				goto out;
+			efm32x_pipeline_pause();
+		}
+		if (__atomic_load_n(&pl->cancel, __ATOMIC_RELAXED))
+			goto out;
+
+		struct efm32x_pipeline_slot *slot = &pl->slot[i % EFM32_PIPELINE_DEPTH];
+		slot->len = pl->encode(pl->priv, i, slot->ops);
+		__atomic_store_n(&pl->head, i + 1, __ATOMIC_RELEASE);
+	}
+
+out:
+	__atomic_store_n(&pl->exited, 1, __ATOMIC_RELEASE);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI efm32x_pipeline_thread(LPVOID priv)
+{
+	efm32x_pipeline_work(priv);
+	return 0;
+}
+#else
+static void *efm32x_pipeline_thread(void *priv)
+{
+	efm32x_pipeline_work(priv);
+	return NULL;
+}
+#endif
+
+/* Start encoding n_items items of up to ops_size bytes with encode */
+static int efm32x_pipeline_start(struct efm32x_pipeline *pl, uint32_t n_items,
+	uint32_t ops_size, efm32x_pipeline_fn encode, void *priv)
+{
+	memset(pl, 0, sizeof(*pl));
+	pl->encode = encode;
+	pl->priv = priv;
+	pl->n_items = n_items;
+
+	for (int i = 0; i < EFM32_PIPELINE_DEPTH; i++) {
+		pl->slot[i].ops = malloc(ops_size);
+		if (!pl->slot[i].ops) {
+			LOG_ERROR("no memory for page op buffers");
+			for (int j = 0; j < i; j++)
+				free(pl->slot[j].ops);
+			return ERROR_FAIL;
+		}
+	}
+
+#ifdef _WIN32
+	pl->thread = CreateThread(NULL, 0, efm32x_pipeline_thread, pl, 0, NULL);
+	pl->threaded = pl->thread != NULL;
+#else
+	pl->threaded = !pthread_create(&pl->thread, NULL, efm32x_pipeline_thread, pl);
+#endif
+	if (!pl->threaded)
+		LOG_DEBUG("no worker thread, encoding pages inline");
+
+	return ERROR_OK;
+}
+
+/*
+ * Slot of item i once it is encoded, waiting for the worker if it is behind.
+ * Items must be taken in order. NULL if the worker stopped or got stuck.
+ */
+static const struct efm32x_pipeline_slot *efm32x_pipeline_next(struct efm32x_pipeline *pl,
+	uint32_t i)
+{
+	struct efm32x_pipeline_slot *slot = &pl->slot[i % EFM32_PIPELINE_DEPTH];
+	int64_t then = timeval_ms();
+
+	if (!pl->threaded) {
+		slot->len = pl->encode(pl->priv, i, slot->ops);
+		return slot;
+	}
+
+	while (__atomic_load_n(&pl->head, __ATOMIC_ACQUIRE) <= i) {
+		if (__atomic_load_n(&pl->exited, __ATOMIC_ACQUIRE)
+				&& __atomic_load_n(&pl->head, __ATOMIC_ACQUIRE) <= i) {
+			LOG_ERROR("page encoder stopped before page %" PRIu32, i);
+			return NULL;
+		}
+		if (timeval_ms() - then > EFM32_PIPELINE_TMO) {
+			LOG_ERROR("timed out waiting for the page encoder");
+			return NULL;
+		}
+		efm32x_pipeline_pause();
+	}
+	return slot;
+}
+
+/* Hand the slot of item i back to the worker */
+static void efm32x_pipeline_done(struct efm32x_pipeline *pl, uint32_t i)
+{
+	__atomic_store_n(&pl->tail, i + 1, __ATOMIC_RELEASE);
+}
+
+static void efm32x_pipeline_stop(struct efm32x_pipeline *pl)
+{
+	if (pl->threaded) {
+		__atomic_store_n(&pl->cancel, 1, __ATOMIC_RELAXED);
+#ifdef _WIN32
+		WaitForSingleObject(pl->thread, INFINITE);
+		CloseHandle(pl->thread);
+#else
+		pthread_join(pl->thread, NULL);
+#endif
+	}
+
+	for (int i = 0; i < EFM32_PIPELINE_DEPTH; i++)
+		free(pl->slot[i].ops);
+}
+
+/* Read a whole file into a buffer padded with 0xff to a multiple of 4 bytes */
+static int efm32x_read_file(const char *path, uint8_t **data, size_t *size)
+{
+	struct fileio *fileio;
+	size_t file_size, size_read;
+	int ret;
+
+	ret = fileio_open(&fileio, path, FILEIO_READ, FILEIO_BINARY);
+	if (ret != ERROR_OK)
+		return ret;
+
+	ret = fileio_size(fileio, &file_size);
+	if (ret != ERROR_OK) {
+		fileio_close(fileio);
+		return ret;
+	}
+
+	*data = malloc((file_size | 3) + 1);
+	if (!*data) {
+		fileio_close(fileio);
+		LOG_ERROR("no memory for file %s", path);
+		return ERROR_FAIL;
+	}
+	memset(*data, 0xff, (file_size | 3) + 1);
+
+	ret = fileio_read(fileio, file_size, *data, &size_read);
+	fileio_close(fileio);
+	if (ret != ERROR_OK || size_read != file_size) {
+		LOG_ERROR("failed to read %s", path);
+		free(*data);
+		*data = NULL;
+		return ERROR_FAIL;
+	}
+
+	*size = file_size;
+	return ERROR_OK;
+}
+
+/* A read-only mapping of a whole file */
+struct efm32x_file_map {
+	const uint8_t *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+static int efm32x_map_file(const char *path, struct efm32x_file_map *map)
+{
+	memset(map, 0, sizeof(*map));
+
+#ifdef _WIN32
+	LARGE_INTEGER size;
+
+	map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (map->file == INVALID_HANDLE_VALUE) {
+		LOG_ERROR("cannot open %s", path);
+		return ERROR_FILEIO_NOT_FOUND;
+	}
+	if (!GetFileSizeEx(map->file, &size) || size.QuadPart == 0
+			|| (uint64_t)size.QuadPart > UINT32_MAX) {
+		LOG_ERROR("cannot map %s", path);
+		CloseHandle(map->file);
+		return ERROR_FAIL;
+	}
+	map->size = size.QuadPart;
+
+	map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (map->mapping)
+		map->data = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!map->data) {
+		LOG_ERROR("cannot map %s", path);
+		if (map->mapping)
+			CloseHandle(map->mapping);
+		CloseHandle(map->file);
+		return ERROR_FAIL;
+	}
+#else
+	struct stat st;
+
+	map->fd = open(path, O_RDONLY);
+	if (map->fd < 0) {
+		LOG_ERROR("cannot open %s", path);
+		return ERROR_FILEIO_NOT_FOUND;
+	}
+	if (fstat(map->fd, &st) < 0 || st.st_size == 0
+			|| (uint64_t)st.st_size > UINT32_MAX) {
+		LOG_ERROR("cannot map %s", path);
+		close(map->fd);
+		return ERROR_FAIL;
+	}
+	map->size = st.st_size;
+
+	void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+	if (data == MAP_FAILED) {
+		LOG_ERROR("cannot map %s", path);
+		close(map->fd);
+		return ERROR_FAIL;
+	}
+	map->data = data;
+#endif
+
+	return ERROR_OK;
+}
+
+static void efm32x_unmap_file(struct efm32x_file_map *map)
+{
+	if (!map->data)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(map->data);
+	CloseHandle(map->mapping);
+	CloseHandle(map->file);
+#else
+	munmap((void *)map->data, map->size);
+	close(map->fd);
+#endif
+	map->data = NULL;
+}
+
+/**
+ * Program data to bank offset, sending only the difference to ref, which
+ * is expected to be the current flash contents at the same offset.
+ * ref may be shorter than data or NULL; uncovered words are sent in full.
+ */
+struct efm32x_delta_job {
+	const uint8_t *data;
+	const uint8_t *ref;
+	uint32_t ref_count;
+	uint32_t offset;
+	uint32_t count;
+	uint32_t page_size;
+	uint32_t first_page;
+};
+
+/* page op stream of the i-th page of a delta write, runs on the worker */
+static uint32_t efm32x_delta_encode(void *priv, uint32_t i, uint8_t *ops)
+{
+	const struct efm32x_delta_job *job = priv;
+	uint32_t page = job->first_page + i;
+	uint32_t start = page * job->page_size;
+	uint32_t end = start + job->page_size;
+	const uint8_t *page_ref = NULL;
+
+	if (start < job->offset)
+		start = job->offset;
+	if (end > job->offset + job->count)
+		end = job->offset + job->count;
+
+	if (job->ref && end - job->offset <= job->ref_count)
+		page_ref = job->ref + (start - job->offset);
+
+	return efm32x_page_encode(ops, job->data + (start - job->offset), page_ref,
+		(start - page * job->page_size) / 4, (end - start) / 4);
+}
+
+static int efm32x_delta_write(struct flash_bank *bank, const uint8_t *data,
+	const uint8_t *ref, uint32_t ref_count, uint32_t offset, uint32_t count,
+	struct command_invocation *cmd)
+{
+	struct efm32x_page_loader loader;
+	struct efm32x_pipeline pl;
+	uint32_t page_size = bank->sectors[0].size;
+	uint32_t first_page = offset / page_size;
+	uint32_t last_page = (offset + count - 1) / page_size;
+	uint32_t n_patched = 0, n_unchanged = 0, n_sent = 0;
+	int ret, ret2;
+
+	const struct efm32x_delta_job job = {
+		.data = data,
+		.ref = ref,
+		.ref_count = ref_count,
+		.offset = offset,
+		.count = count,
+		.page_size = page_size,
+		.first_page = first_page,
+	};
+
+	/* pages are diffed and encoded while the previous ones are programmed */
+	ret = efm32x_pipeline_start(&pl, last_page - first_page + 1, 2 * page_size + 16,
+		efm32x_delta_encode, (void *)&job);
+	if (ret != ERROR_OK)
+		return ret;
+
+	ret = efm32x_page_loader_init(bank, &loader, page_size);
+	if (ret != ERROR_OK) {
+		efm32x_pipeline_stop(&pl);
+		return ret;
+	}
+
+	ret = efm32x_clock_boost(bank);
+
+	efm32x_msc_lock(bank, 0);
+	if (ret == ERROR_OK)
+		ret = efm32x_set_wren(bank, 1);
+
+	for (uint32_t page = first_page; ret == ERROR_OK && page <= last_page; page++) {
+		const struct efm32x_pipeline_slot *slot = efm32x_pipeline_next(&pl, page - first_page);
+		if (!slot) {
+			ret = ERROR_FAIL;
+			break;
+		}
+		if (slot->len == 0) {
+			efm32x_pipeline_done(&pl, page - first_page);
+			n_unchanged++;
+			continue;
+		}
+
+		keep_alive();
+		ret = efm32x_page_loader_run(bank, &loader,
+			bank->base + page * page_size, slot->ops, slot->len);
+		n_sent += slot->len;
+		efm32x_pipeline_done(&pl, page - first_page);
+		bank->sectors[page].is_erased = 0;
+		n_patched++;
+	}
+
+	ret2 = efm32x_set_wren(bank, 0);
+	efm32x_msc_lock(bank, 1);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	ret2 = efm32x_clock_restore(bank);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	efm32x_page_loader_free(bank, &loader);
+	efm32x_pipeline_stop(&pl);
+
+	if (ret == ERROR_OK)
+		command_print(cmd, "delta write: %" PRIu32 " pages patched (%u without erase), %" PRIu32
+			" unchanged, %" PRIu32 " of %" PRIu32 " bytes sent",
+			n_patched, loader.n_in_place, n_unchanged, n_sent, count);
+
+	return ret;
+}
+
+/*
+ * Flash package: a prebuilt, page aligned image for one page size.
+ * All fields are little endian. The header is followed by one table entry
+ * per page and the page blocks, which are page loader op streams.
+ */
+#define EFM32_PKG_MAGIC                 0x50325345	/* "ES2P" */
+#define EFM32_PKG_VERSION               1
+#define EFM32_PKG_HDR_SZ                32
+#define EFM32_PKG_HDR_MAGIC             0x00
+#define EFM32_PKG_HDR_VERSION           0x04	/* u16 */
+#define EFM32_PKG_HDR_FAMILY            0x06	/* u8, part family number */
+#define EFM32_PKG_HDR_PAGE_SIZE         0x08
+#define EFM32_PKG_HDR_FLASH_KIB         0x0c	/* smallest flash size fitting the image */
+#define EFM32_PKG_HDR_BASE              0x10	/* address of the first page */
+#define EFM32_PKG_HDR_N_PAGES           0x14
+#define EFM32_PKG_HDR_CRC               0x18	/* CRC32 of everything after the header */
+#define EFM32_PKG_ENTRY_SZ              12
+#define EFM32_PKG_ENTRY_CRC             0x00	/* CRC32 of the whole page */
+#define EFM32_PKG_ENTRY_OFFSET          0x04	/* file offset of the block */
+#define EFM32_PKG_ENTRY_LEN             0x08	/* block length */
+
+struct efm32x_pkg {
+	const uint8_t *data;
+	uint8_t family;
+	uint32_t page_size;
+	uint32_t flash_kib;
+	uint32_t base;
+	uint32_t n_pages;
+};
+
+static int efm32x_pkg_parse(struct efm32x_pkg *pkg, const uint8_t *data, size_t size)
+{
+	if (size < EFM32_PKG_HDR_SZ || le_to_h_u32(data + EFM32_PKG_HDR_MAGIC) != EFM32_PKG_MAGIC) {
+		LOG_ERROR("not an efm32s2 flash package");
+		return ERROR_FAIL;
+	}
+	if (le_to_h_u16(data + EFM32_PKG_HDR_VERSION) != EFM32_PKG_VERSION) {
+		LOG_ERROR("unsupported flash package version %d",
+			le_to_h_u16(data + EFM32_PKG_HDR_VERSION));
+		return ERROR_FAIL;
+	}
+
+	pkg->data = data;
+	pkg->family = data[EFM32_PKG_HDR_FAMILY];
+	pkg->page_size = le_to_h_u32(data + EFM32_PKG_HDR_PAGE_SIZE);
+	pkg->flash_kib = le_to_h_u32(data + EFM32_PKG_HDR_FLASH_KIB);
+	pkg->base = le_to_h_u32(data + EFM32_PKG_HDR_BASE);
+	pkg->n_pages = le_to_h_u32(data + EFM32_PKG_HDR_N_PAGES);
+
+	if (pkg->n_pages > (size - EFM32_PKG_HDR_SZ) / EFM32_PKG_ENTRY_SZ) {
+		LOG_ERROR("flash package truncated");
+		return ERROR_FAIL;
+	}
+	if (pkg->page_size == 0 || pkg->page_size % 4 || pkg->page_size > 0x10000) {
+		LOG_ERROR("flash package page size 0x%" PRIx32 " invalid", pkg->page_size);
+		return ERROR_FAIL;
+	}
+
+	uint32_t crc;
+	int ret = image_calculate_checksum(data + EFM32_PKG_HDR_SZ,
+		size - EFM32_PKG_HDR_SZ, &crc);
+	if (ret != ERROR_OK)
+		return ret;
+	if (crc != le_to_h_u32(data + EFM32_PKG_HDR_CRC)) {
+		LOG_ERROR("flash package CRC mismatch");
+		return ERROR_FAIL;
+	}
+
+	for (uint32_t i = 0; i < pkg->n_pages; i++) {
+		const uint8_t *entry = data + EFM32_PKG_HDR_SZ + i * EFM32_PKG_ENTRY_SZ;
+		uint32_t offset = le_to_h_u32(entry + EFM32_PKG_ENTRY_OFFSET);
+		uint32_t len = le_to_h_u32(entry + EFM32_PKG_ENTRY_LEN);
+		if (offset > size || len > size - offset || len > EFM32_PAGE_OPS_SZ(pkg->page_size)) {
+			LOG_ERROR("flash package block %" PRIu32 " out of range", i);
+			return ERROR_FAIL;
+		}
+		/* the loader trusts its ops, so a bad one must not reach the target */
+		if (!efm32x_page_ops_valid(data + offset, len, pkg->page_size / 4)) {
+			LOG_ERROR("flash package block %" PRIu32 " is not a valid op stream "
+				"for a 0x%" PRIx32 " byte page", i, pkg->page_size);
+			return ERROR_FAIL;
+		}
+	}
+
+	return ERROR_OK;
+}
+
+/**
+ * Lay out image for a part family, page and flash size and write it to path
+ * as a flash package. Pages are CRCed and encoded once, here.
+ */
+static int efm32x_pkg_build(const char *path, struct image *image, uint8_t family,
+	uint32_t page_size, uint32_t flash_kib, struct command_invocation *cmd)
+{
+	uint32_t base = family == 23 ? EFM32_FLASH_BASE_G23 : EFM32_FLASH_BASE;
+	uint32_t flash_size = flash_kib * 1024;
+	uint32_t lo = UINT32_MAX, hi = 0;
+	uint8_t *pages = NULL, *out = NULL;
+	int ret = ERROR_OK;
+
+	for (unsigned int i = 0; i < image->num_sections; i++) {
+		target_addr_t start = image->sections[i].base_address;
+		target_addr_t end = start + image->sections[i].size;
+		if (image->sections[i].size == 0)
+			continue;
+		if (start < base || end > base + flash_size) {
+			LOG_ERROR("image section at " TARGET_ADDR_FMT " outside of flash", start);
+			return ERROR_FLASH_DST_OUT_OF_BANK;
+		}
+		if (start - base < lo)
+			lo = start - base;
+		if (end - base > hi)
+			hi = end - base;
+	}
+	if (lo >= hi) {
+		LOG_ERROR("image has no data");
+		return ERROR_FAIL;
+	}
+
+	lo -= lo % page_size;
+	hi = (hi + page_size - 1) / page_size * page_size;
+	uint32_t n_pages = (hi - lo) / page_size;
+
+	/* worst case: every page stored as literals */
+	size_t out_size = EFM32_PKG_HDR_SZ + n_pages * (EFM32_PKG_ENTRY_SZ +
+		EFM32_PAGE_OPS_SZ(page_size));
+	pages = malloc(hi - lo);
+	out = malloc(out_size + page_size + 16);
+	if (!pages || !out) {
+		LOG_ERROR("no memory for flash package");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+	memset(pages, 0xff, hi - lo);
+	memset(out, 0, EFM32_PKG_HDR_SZ + n_pages * EFM32_PKG_ENTRY_SZ);
+
+	for (unsigned int i = 0; i < image->num_sections; i++) {
+		size_t size_read;
+		ret = image_read_section(image, i, 0, image->sections[i].size,
+			pages + (image->sections[i].base_address - base - lo), &size_read);
+		if (ret != ERROR_OK)
+			goto cleanup;
+	}
+
+	size_t len = EFM32_PKG_HDR_SZ + n_pages * EFM32_PKG_ENTRY_SZ;
+	for (uint32_t i = 0; i < n_pages; i++) {
+		uint8_t *entry = out + EFM32_PKG_HDR_SZ + i * EFM32_PKG_ENTRY_SZ;
+		uint32_t crc;
+
+		ret = image_calculate_checksum(pages + i * page_size, page_size, &crc);
+		if (ret != ERROR_OK)
+			goto cleanup;
+
+		/* encoding needs scratch space beyond the block */
+		uint32_t block_len = efm32x_page_encode(out + len, pages + i * page_size,
+			NULL, 0, page_size / 4);
+		h_u32_to_le(entry + EFM32_PKG_ENTRY_CRC, crc);
+		h_u32_to_le(entry + EFM32_PKG_ENTRY_OFFSET, len);
+		h_u32_to_le(entry + EFM32_PKG_ENTRY_LEN, block_len);
+		len += block_len;
+	}
+
+	uint32_t crc;
+	ret = image_calculate_checksum(out + EFM32_PKG_HDR_SZ, len - EFM32_PKG_HDR_SZ, &crc);
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	h_u32_to_le(out + EFM32_PKG_HDR_MAGIC, EFM32_PKG_MAGIC);
+	h_u16_to_le(out + EFM32_PKG_HDR_VERSION, EFM32_PKG_VERSION);
+	out[EFM32_PKG_HDR_FAMILY] = family;
+	h_u32_to_le(out + EFM32_PKG_HDR_PAGE_SIZE, page_size);
+	h_u32_to_le(out + EFM32_PKG_HDR_FLASH_KIB, (hi + 1023) / 1024);
+	h_u32_to_le(out + EFM32_PKG_HDR_BASE, base + lo);
+	h_u32_to_le(out + EFM32_PKG_HDR_N_PAGES, n_pages);
+	h_u32_to_le(out + EFM32_PKG_HDR_CRC, crc);
+
+	struct fileio *fileio;
+	size_t written;
+	ret = fileio_open(&fileio, path, FILEIO_WRITE, FILEIO_BINARY);
+	if (ret != ERROR_OK)
+		goto cleanup;
+	ret = fileio_write(fileio, len, out, &written);
+	fileio_close(fileio);
+	if (ret == ERROR_OK && written != len)
+		ret = ERROR_FILEIO_OPERATION_FAILED;
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	command_print(cmd, "packed %" PRIu32 " pages at 0x%8.8" PRIx32 " into %zu bytes",
+		n_pages, base + lo, len);
+
+cleanup:
+	free(out);
+	free(pages);
+	return ret;
+}
+
+/* Program a flash package, skipping pages whose CRC matches unless forced */
+static int efm32x_pkg_write(struct flash_bank *bank, const struct efm32x_pkg *pkg,
+	bool force, struct command_invocation *cmd)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct efm32_info *info = &efm32x_info->info;
+	struct efm32x_page_loader loader;
+	unsigned int n_written = 0, n_skipped = 0;
+	int ret, ret2;
+
+	if (pkg->family != info->part_family_num || pkg->page_size != info->page_size
+			|| pkg->flash_kib > info->flash_sz_kib) {
+		LOG_ERROR("package for xG%d, %" PRIu32 " byte pages, %" PRIu32 " kB flash "
+			"doesn't fit this xG%d with %d byte pages and %d kB flash",
+			pkg->family, pkg->page_size, pkg->flash_kib,
+			info->part_family_num, info->page_size, info->flash_sz_kib);
+		return ERROR_FAIL;
+	}
+	if (pkg->base < bank->base || (pkg->base - bank->base) % pkg->page_size
+			|| pkg->base - bank->base + pkg->n_pages * pkg->page_size > bank->size) {
+		LOG_ERROR("package does not fit into flash bank %u", bank->bank_number);
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+	}
+
+	bool *skip = calloc(pkg->n_pages, sizeof(*skip));
+	if (!skip) {
+		LOG_ERROR("no memory for page table");
+		return ERROR_FAIL;
+	}
+
+	/* the page manifest saves checksumming each page on the target */
+	struct efm32x_manifest *manifest = force ? NULL : efm32x_manifest_check(bank);
+	for (uint32_t i = 0; !force && i < pkg->n_pages; i++) {
+		const uint8_t *entry = pkg->data + EFM32_PKG_HDR_SZ + i * EFM32_PKG_ENTRY_SZ;
+		uint32_t addr = pkg->base + i * pkg->page_size;
+		uint32_t crc;
+
+		if (!efm32x_manifest_lookup(manifest, addr, &crc)) {
+			ret = target_checksum_memory(bank->target, addr, pkg->page_size, &crc);
+			if (ret != ERROR_OK) {
+				free(skip);
+				return ret;
+			}
+		}
+		skip[i] = crc == le_to_h_u32(entry + EFM32_PKG_ENTRY_CRC);
+	}
+
+	ret = efm32x_page_loader_init(bank, &loader, pkg->page_size);
+	if (ret != ERROR_OK) {
+		free(skip);
+		return ret;
+	}
+
+	ret = efm32x_clock_boost(bank);
+
+	efm32x_msc_lock(bank, 0);
+	if (ret == ERROR_OK)
+		ret = efm32x_set_wren(bank, 1);
+
+	for (uint32_t i = 0; ret == ERROR_OK && i < pkg->n_pages; i++) {
+		const uint8_t *entry = pkg->data + EFM32_PKG_HDR_SZ + i * EFM32_PKG_ENTRY_SZ;
+		uint32_t page = (pkg->base - bank->base) / pkg->page_size + i;
+
+		if (skip[i]) {
+			n_skipped++;
+			continue;
+		}
+
+		keep_alive();
+		ret = efm32x_page_loader_run(bank, &loader, pkg->base + i * pkg->page_size,
+			pkg->data + le_to_h_u32(entry + EFM32_PKG_ENTRY_OFFSET),
+			le_to_h_u32(entry + EFM32_PKG_ENTRY_LEN));
+		bank->sectors[page].is_erased = 0;
+		n_written++;
+	}
+
+	ret2 = efm32x_set_wren(bank, 0);
+	efm32x_msc_lock(bank, 1);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	ret2 = efm32x_clock_restore(bank);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	efm32x_page_loader_free(bank, &loader);
+	free(skip);
+
+	if (ret == ERROR_OK && efm32x_get_bank_index(bank->base) == EFM32_BANK_INDEX_MAIN) {
+		uint32_t *crc = malloc(pkg->n_pages * sizeof(*crc));
+		if (!crc) {
+			LOG_ERROR("no memory for page CRCs");
+			return ERROR_FAIL;
+		}
+		for (uint32_t i = 0; i < pkg->n_pages; i++)
+			crc[i] = le_to_h_u32(pkg->data + EFM32_PKG_HDR_SZ + i * EFM32_PKG_ENTRY_SZ
+				+ EFM32_PKG_ENTRY_CRC);
+		ret = efm32x_manifest_write(bank, pkg->base, pkg->n_pages, crc);
+		free(crc);
+	}
+
+	if (ret == ERROR_OK)
+		command_print(cmd, "package: %u pages written (%u without erase), %u up to date",
+			n_written, loader.n_in_place, n_skipped);
+
+	return ret;
+}
+
+/*
+ * Flash snapshot: a range of pages as sent by the compressing readback
+ * loader. All fields are little endian. The header is followed by the
+ * loader's op stream, LIT and FILL ops with an END op after each page.
+ */
+#define EFM32_SNAP_MAGIC                0x53325345	/* "ES2S" */
+#define EFM32_SNAP_VERSION              1
+#define EFM32_SNAP_HDR_SZ               32
+#define EFM32_SNAP_HDR_MAGIC            0x00
+#define EFM32_SNAP_HDR_VERSION          0x04	/* u16 */
+#define EFM32_SNAP_HDR_FAMILY           0x06	/* u8, part family number */
+#define EFM32_SNAP_HDR_PAGE_SIZE        0x08
+#define EFM32_SNAP_HDR_BASE             0x0c	/* address of the first page */
+#define EFM32_SNAP_HDR_N_PAGES          0x10
+#define EFM32_SNAP_HDR_LEN              0x14	/* op stream length */
+#define EFM32_SNAP_HDR_CRC              0x18	/* CRC32 of the flash contents */
+
+/* worst case readback of a page: all 16 word blocks as literals */
+#define EFM32_SNAP_PAGE_MAX(page_size)  ((page_size) / 16 * 17 + 4)
+
+struct efm32x_snap {
+	const uint8_t *ops;
+	uint8_t family;
+	uint32_t page_size;
+	uint32_t base;
+	uint32_t n_pages;
+	uint32_t len;
+	uint32_t crc;
+};
+
+/*
+ * Decode the next page of a readback op stream at *pos into page, if given.
+ * Returns ERROR_OK and moves *pos past the page, ERROR_WAIT if the stream
+ * ends within the page, or ERROR_FAIL if it is malformed.
+ */
+static int efm32x_snap_decode(const uint8_t *ops, uint32_t len, uint32_t *pos,
+	uint8_t *page, uint32_t n_words)
+{
+	uint32_t i = *pos, n = 0;
+
+	while (len - i >= 4) {
+		uint32_t op = le_to_h_u32(ops + i);
+		uint32_t count = op & 0xffff;
+
+		switch (op >> 16) {
+		case EFM32_PAGE_OP_END:
+			if (n != n_words)
+				return ERROR_FAIL;
+			*pos = i + 4;
+			return ERROR_OK;
+		case EFM32_PAGE_OP_LIT:
+			if (count > n_words - n)
+				return ERROR_FAIL;
+			if (len - i - 4 < count * 4)
+				return ERROR_WAIT;
+			if (page)
+				memcpy(page + n * 4, ops + i + 4, count * 4);
+			i += 4 + count * 4;
+			break;
+		case EFM32_PAGE_OP_FILL:
+			if (count > n_words - n)
+				return ERROR_FAIL;
+			if (len - i < 8)
+				return ERROR_WAIT;
+			for (uint32_t k = 0; page && k < count; k++)
+				memcpy(page + (n + k) * 4, ops + i + 4, 4);
+			i += 8;
+			break;
+		default:
+			return ERROR_FAIL;
+		}
+		n += count;
+	}
+
+	return ERROR_WAIT;
+}
+
+/*
+ * Run the readback loader over n_pages pages from addr and collect its op
+ * stream, at most max bytes, in ops. The loader reads flash at core speed
+ * and only the compressed stream crosses the debug link.
+ */
+static int efm32x_readback(struct flash_bank *bank, uint32_t addr,
+	uint32_t n_pages, uint32_t page_size, uint8_t *ops, uint32_t max,
+	uint32_t *len)
+{
+	struct target *target = bank->target;
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t buffer_size = EFM32_FIFO_SIZE;
+	struct working_area *read_algorithm;
+	struct working_area *fifo;
+	struct reg_param reg_params[5];
+	struct armv7m_algorithm armv7m_info;
+	int ret, ret2;
+
+	if (target_alloc_working_area(target, sizeof(efm32x_flash_read_code),
+			&read_algorithm) != ERROR_OK) {
+		LOG_WARNING("no working area available, can't run readback loader");
+		return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+	}
+
+	ret = target_write_buffer(target, read_algorithm->address,
+			sizeof(efm32x_flash_read_code), efm32x_flash_read_code);
+	if (ret != ERROR_OK) {
+		target_free_working_area(target, read_algorithm);
+		return ret;
+	}
+
+	while (target_alloc_working_area_try(target, buffer_size, &fifo) != ERROR_OK) {
+		buffer_size /= 2;
+		buffer_size &= ~3UL;
+		if (buffer_size <= 256) {
+			target_free_working_area(target, read_algorithm);
+			LOG_WARNING("no large enough working area available, can't run readback loader");
+			return ERROR_TARGET_RESOURCE_NOT_AVAILABLE;
+		}
+	}
+
+	/* write and read pointer, followed by the data */
+	uint32_t start = fifo->address + 8;
+	uint32_t end = fifo->address + fifo->size;
+	ret = target_write_u32(target, fifo->address, start);
+	if (ret == ERROR_OK)
+		ret = target_write_u32(target, fifo->address + 4, start);
+	if (ret != ERROR_OK) {
+		target_free_working_area(target, fifo);
+		target_free_working_area(target, read_algorithm);
+		return ret;
+	}
+
+	init_reg_param(&reg_params[0], "r0", 32, PARAM_IN_OUT);	/* flash address (in), status (out) */
+	init_reg_param(&reg_params[1], "r1", 32, PARAM_OUT);	/* page count */
+	init_reg_param(&reg_params[2], "r2", 32, PARAM_OUT);	/* FIFO start */
+	init_reg_param(&reg_params[3], "r3", 32, PARAM_OUT);	/* FIFO end */
+	init_reg_param(&reg_params[4], "r4", 32, PARAM_OUT);	/* page size */
+
+	buf_set_u32(reg_params[0].value, 0, 32, addr);
+	buf_set_u32(reg_params[1].value, 0, 32, n_pages);
+	buf_set_u32(reg_params[2].value, 0, 32, fifo->address);
+	buf_set_u32(reg_params[3].value, 0, 32, end);
+	buf_set_u32(reg_params[4].value, 0, 32, page_size);
+
+	armv7m_info.common_magic = ARMV7M_COMMON_MAGIC;
+	armv7m_info.core_mode = ARM_MODE_THREAD;
+
+	efm32x_info->n_algo_runs++;
+	ret = target_start_algorithm(target, 0, NULL, 5, reg_params,
+			read_algorithm->address, 0, &armv7m_info);
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	uint32_t rp = start, n = 0, pos = 0, done = 0;
+	int64_t last = timeval_ms();
+	while (done < n_pages) {
+		uint32_t wp;
+		ret = target_read_u32(target, fifo->address, &wp);
+		if (ret != ERROR_OK)
+			break;
+
+		if (wp == rp) {
+			if (timeval_ms() - last > EFM32_READBACK_TMO) {
+				LOG_ERROR("readback loader stalled in page %" PRIu32, done);
+				ret = ERROR_TARGET_TIMEOUT;
+				break;
+			}
+			keep_alive();
+			continue;
+		}
+		if (wp < start || wp >= end || (wp & 3)) {
+			LOG_ERROR("readback loader FIFO corrupted");
+			ret = ERROR_FAIL;
+			break;
+		}
+
+		/* up to the write pointer, or the end of the FIFO if it wrapped */
+		uint32_t chunk = (wp > rp ? wp : end) - rp;
+		if (chunk > max - n) {
+			LOG_ERROR("readback loader sent more than %" PRIu32 " bytes", max);
+			ret = ERROR_FAIL;
+			break;
+		}
+		ret = target_read_buffer(target, rp, chunk, ops + n);
+		if (ret != ERROR_OK)
+			break;
+		n += chunk;
+		rp += chunk;
+		if (rp == end)
+			rp = start;
+		ret = target_write_u32(target, fifo->address + 4, rp);
+		if (ret != ERROR_OK)
+			break;
+		last = timeval_ms();
+
+		while (done < n_pages
+				&& (ret = efm32x_snap_decode(ops, n, &pos, NULL, page_size / 4)) == ERROR_OK)
+			done++;
+		if (ret == ERROR_WAIT)
+			ret = ERROR_OK;
+		if (ret != ERROR_OK) {
+			LOG_ERROR("readback loader sent a bad op stream in page %" PRIu32, done);
+			break;
+		}
+	}
+
+	if (ret != ERROR_OK)
+		target_halt(target);
+
+	ret2 = target_wait_algorithm(target, 0, NULL, 5, reg_params, 0,
+			EFM32_FLASH_PAGE_TMO, &armv7m_info);
+	if (ret == ERROR_OK)
+		ret = ret2;
+	if (ret == ERROR_OK && (pos != n || buf_get_u32(reg_params[0].value, 0, 32))) {
+		LOG_ERROR("readback loader failed");
+		ret = ERROR_FAIL;
+	}
+	*len = pos;
+
+cleanup:
+	target_free_working_area(target, fifo);
+	target_free_working_area(target, read_algorithm);
+
+	for (int i = 0; i < 5; i++)
+		destroy_reg_param(&reg_params[i]);
+
+	return ret;
+}
+
+static int efm32x_snap_parse(struct efm32x_snap *snap, const uint8_t *data, size_t size)
+{
+	if (size < EFM32_SNAP_HDR_SZ || le_to_h_u32(data + EFM32_SNAP_HDR_MAGIC) != EFM32_SNAP_MAGIC) {
+		LOG_ERROR("not an efm32s2 flash snapshot");
+		return ERROR_FAIL;
+	}
+	if (le_to_h_u16(data + EFM32_SNAP_HDR_VERSION) != EFM32_SNAP_VERSION) {
+		LOG_ERROR("unsupported flash snapshot version %d",
+			le_to_h_u16(data + EFM32_SNAP_HDR_VERSION));
+		return ERROR_FAIL;
+	}
+
+	snap->ops = data + EFM32_SNAP_HDR_SZ;
+	snap->family = data[EFM32_SNAP_HDR_FAMILY];
+	snap->page_size = le_to_h_u32(data + EFM32_SNAP_HDR_PAGE_SIZE);
+	snap->base = le_to_h_u32(data + EFM32_SNAP_HDR_BASE);
+	snap->n_pages = le_to_h_u32(data + EFM32_SNAP_HDR_N_PAGES);
+	snap->len = le_to_h_u32(data + EFM32_SNAP_HDR_LEN);
+	snap->crc = le_to_h_u32(data + EFM32_SNAP_HDR_CRC);
+
+	if (snap->len > size - EFM32_SNAP_HDR_SZ) {
+		LOG_ERROR("flash snapshot truncated");
+		return ERROR_FAIL;
+	}
+
+	return ERROR_OK;
+}
+
+/* Read the whole bank back through the readback loader into a snapshot file */
+static int efm32x_snap_save(struct flash_bank *bank, const char *path,
+	struct command_invocation *cmd)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t page_size = bank->sectors[0].size;
+	uint32_t n_pages = bank->num_sectors;
+	uint32_t max = n_pages * EFM32_SNAP_PAGE_MAX(page_size);
+	uint32_t len = 0, crc, flash_crc;
+	int ret;
+
+	uint8_t *out = malloc(EFM32_SNAP_HDR_SZ + max);
+	uint8_t *contents = malloc(bank->size);
+	if (!out || !contents) {
+		LOG_ERROR("no memory for flash snapshot");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	int64_t start = timeval_ms();
+	ret = efm32x_readback(bank, bank->base, n_pages, page_size,
+		out + EFM32_SNAP_HDR_SZ, max, &len);
+	if (ret != ERROR_OK)
+		goto cleanup;
+	int64_t elapsed = timeval_ms() - start;
+
+	/* check the stream against the flash before trusting it as a backup */
+	for (uint32_t i = 0, pos = 0; i < n_pages; i++) {
+		if (efm32x_snap_decode(out + EFM32_SNAP_HDR_SZ, len, &pos,
+				contents + i * page_size, page_size / 4) != ERROR_OK) {
+			LOG_ERROR("flash snapshot stream is corrupted at page %" PRIu32, i);
+			ret = ERROR_FAIL;
+			goto cleanup;
+		}
+	}
+	ret = image_calculate_checksum(contents, bank->size, &crc);
+	if (ret == ERROR_OK)
+		ret = target_checksum_memory(bank->target, bank->base, bank->size, &flash_crc);
+	if (ret != ERROR_OK)
+		goto cleanup;
+	if (crc != flash_crc) {
+		LOG_ERROR("flash snapshot doesn't match the flash contents");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	memset(out, 0, EFM32_SNAP_HDR_SZ);
+	h_u32_to_le(out + EFM32_SNAP_HDR_MAGIC, EFM32_SNAP_MAGIC);
+	h_u16_to_le(out + EFM32_SNAP_HDR_VERSION, EFM32_SNAP_VERSION);
+	out[EFM32_SNAP_HDR_FAMILY] = efm32x_info->info.part_family_num;
+	h_u32_to_le(out + EFM32_SNAP_HDR_PAGE_SIZE, page_size);
+	h_u32_to_le(out + EFM32_SNAP_HDR_BASE, bank->base);
+	h_u32_to_le(out + EFM32_SNAP_HDR_N_PAGES, n_pages);
+	h_u32_to_le(out + EFM32_SNAP_HDR_LEN, len);
+	h_u32_to_le(out + EFM32_SNAP_HDR_CRC, crc);
+
+	struct fileio *fileio;
+	size_t written;
+	ret = fileio_open(&fileio, path, FILEIO_WRITE, FILEIO_BINARY);
+	if (ret != ERROR_OK)
+		goto cleanup;
+	ret = fileio_write(fileio, EFM32_SNAP_HDR_SZ + len, out, &written);
+	fileio_close(fileio);
+	if (ret == ERROR_OK && written != EFM32_SNAP_HDR_SZ + len)
+		ret = ERROR_FILEIO_OPERATION_FAILED;
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	command_print(cmd, "snapshot: %" PRIu32 " pages, %" PRIu32 " bytes read for %" PRIu32
+		" (%" PRIu32 "%%) in %" PRId64 " ms", n_pages, len, bank->size,
+		(uint32_t)((uint64_t)len * 100 / bank->size), elapsed);
+
+cleanup:
+	free(contents);
+	free(out);
+	return ret;
+}
+
+static bool efm32x_page_is_erased(const uint8_t *page, uint32_t page_size)
+{
+	for (uint32_t i = 0; i < page_size; i++) {
+		if (page[i] != 0xff)
+			return false;
+	}
+	return true;
+}
+
+struct efm32x_restore_job {
+	const uint8_t *contents;
+	uint32_t page_size;
+	/* pages up to date in flash already */
+	const bool *skip;
+};
+
+/* page op stream of the i-th page of a snapshot, 0 if it's erased or skipped */
+static uint32_t efm32x_restore_encode(void *priv, uint32_t i, uint8_t *ops)
+{
+	const struct efm32x_restore_job *job = priv;
+	const uint8_t *page = job->contents + i * job->page_size;
+
+	if (job->skip[i] || efm32x_page_is_erased(page, job->page_size))
+		return 0;
+	return efm32x_page_encode(ops, page, NULL, 0, job->page_size / 4);
+}
+
+/*
+ * Program a flash snapshot back. Pages whose CRC matches are skipped unless
+ * forced, erased pages are only erased, the others go to the page loader.
+ */
+static int efm32x_snap_restore(struct flash_bank *bank, const struct efm32x_snap *snap,
+	bool force, struct command_invocation *cmd)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32x_page_loader loader;
+	struct efm32x_pipeline pl;
+	uint32_t size = snap->n_pages * snap->page_size;
+	unsigned int n_written = 0, n_erased = 0, n_skipped = 0;
+	uint32_t crc;
+	int ret, ret2;
+
+	if (snap->page_size != bank->sectors[0].size) {
+		LOG_ERROR("snapshot of %" PRIu32 " byte pages doesn't fit the %" PRIu32
+			" byte pages of flash bank %u", snap->page_size, bank->sectors[0].size,
+			bank->bank_number);
+		return ERROR_FAIL;
+	}
+	if (snap->base < bank->base || (snap->base - bank->base) % snap->page_size
+			|| snap->n_pages > bank->size / snap->page_size
+			|| snap->base - bank->base > bank->size - size) {
+		LOG_ERROR("snapshot does not fit into flash bank %u", bank->bank_number);
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+	}
+	if (snap->family != efm32x_info->info.part_family_num)
+		LOG_WARNING("snapshot taken from an xG%d", snap->family);
+
+	uint8_t *contents = malloc(size);
+	uint32_t *page_crc = malloc(snap->n_pages * sizeof(*page_crc));
+	bool *skip = calloc(snap->n_pages, sizeof(*skip));
+	if (!contents || !page_crc || !skip) {
+		LOG_ERROR("no memory for flash snapshot");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	ret = ERROR_OK;
+	for (uint32_t i = 0, pos = 0; ret == ERROR_OK && i < snap->n_pages; i++) {
+		ret = efm32x_snap_decode(snap->ops, snap->len, &pos,
+			contents + i * snap->page_size, snap->page_size / 4);
+		if (ret == ERROR_OK)
+			ret = image_calculate_checksum(contents + i * snap->page_size,
+				snap->page_size, &page_crc[i]);
+	}
+	if (ret == ERROR_OK)
+		ret = image_calculate_checksum(contents, size, &crc);
+	if (ret == ERROR_OK && crc != snap->crc)
+		ret = ERROR_FAIL;
+	if (ret != ERROR_OK) {
+		LOG_ERROR("flash snapshot corrupted");
+		goto cleanup;
+	}
+
+	struct efm32x_manifest *manifest = force ? NULL : efm32x_manifest_check(bank);
+
+	/* decided before the worker starts, it encodes nothing for these */
+	for (uint32_t i = 0; !force && i < snap->n_pages; i++) {
+		uint32_t addr = snap->base + i * snap->page_size;
+		uint32_t flash_crc;
+
+		if (!efm32x_manifest_lookup(manifest, addr, &flash_crc)) {
+			ret = target_checksum_memory(bank->target, addr, snap->page_size,
+				&flash_crc);
+			if (ret != ERROR_OK)
+				goto cleanup;
+		}
+		skip[i] = page_crc[i] == flash_crc;
+	}
+
+	/* pages are encoded while the previous ones are programmed */
+	const struct efm32x_restore_job job = {
+		.contents = contents,
+		.page_size = snap->page_size,
+		.skip = skip,
+	};
+	ret = efm32x_pipeline_start(&pl, snap->n_pages, 2 * snap->page_size + 16,
+		efm32x_restore_encode, (void *)&job);
+	if (ret != ERROR_OK)
+		goto cleanup;
+
+	ret = efm32x_page_loader_init(bank, &loader, snap->page_size);
+	if (ret != ERROR_OK) {
+		efm32x_pipeline_stop(&pl);
+		goto cleanup;
+	}
+
+	ret = efm32x_clock_boost(bank);
+
+	efm32x_msc_lock(bank, 0);
+	if (ret == ERROR_OK)
+		ret = efm32x_set_wren(bank, 1);
+
+	for (uint32_t i = 0; ret == ERROR_OK && i < snap->n_pages; i++) {
+		uint32_t addr = snap->base + i * snap->page_size;
+		uint32_t n = (addr - bank->base) / snap->page_size;
+
+		keep_alive();
+		const struct efm32x_pipeline_slot *slot = efm32x_pipeline_next(&pl, i);
+		if (!slot) {
+			ret = ERROR_FAIL;
+			break;
+		}
+		if (skip[i]) {
+			efm32x_pipeline_done(&pl, i);
+			n_skipped++;
+			continue;
+		}
+		if (slot->len == 0) {
+			efm32x_pipeline_done(&pl, i);
+			ret = efm32x_erase_page(bank, addr);
+			if (ret != ERROR_OK) {
+				efm32x_cache_invalidate(efm32x_info, addr, snap->page_size);
+			} else {
+				efm32x_cache_erased(efm32x_info, addr);
+				bank->sectors[n].is_erased = 1;
+			}
+			n_erased++;
+			continue;
+		}
+
+		ret = efm32x_page_loader_run(bank, &loader, addr, slot->ops, slot->len);
+		efm32x_pipeline_done(&pl, i);
+		bank->sectors[n].is_erased = 0;
+		n_written++;
+	}
+
+	ret2 = efm32x_set_wren(bank, 0);
+	efm32x_msc_lock(bank, 1);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	ret2 = efm32x_clock_restore(bank);
+	if (ret == ERROR_OK)
+		ret = ret2;
+
+	efm32x_page_loader_free(bank, &loader);
+	efm32x_pipeline_stop(&pl);
+
+	if (ret == ERROR_OK)
+		ret = target_checksum_memory(bank->target, snap->base, size, &crc);
+	if (ret == ERROR_OK && crc != snap->crc) {
+		LOG_ERROR("flash contents don't match the snapshot after restore");
+		ret = ERROR_FAIL;
+	}
+	if (ret == ERROR_OK && efm32x_get_bank_index(bank->base) == EFM32_BANK_INDEX_MAIN)
+		ret = efm32x_manifest_write(bank, snap->base, snap->n_pages, page_crc);
+
+	if (ret == ERROR_OK)
+		command_print(cmd, "restore: %u pages written (%u without erase), %u erased, "
+			"%u up to date", n_written, loader.n_in_place, n_erased, n_skipped);
+
+cleanup:
+	free(skip);
+	free(page_crc);
+	free(contents);
+	return ret;
+}
+
+enum efm32x_bg_state {
+	EFM32_BG_RUNNING,
+	EFM32_BG_DONE,
+	EFM32_BG_FAILED,
+	EFM32_BG_CANCELLED,
+};
+
+static const char * const efm32x_bg_state_names[] = {
+	[EFM32_BG_RUNNING] = "running",
+	[EFM32_BG_DONE] = "done",
+	[EFM32_BG_FAILED] = "failed",
+	[EFM32_BG_CANCELLED] = "cancelled",
+};
+
+/* A page-by-page programming job, stepped from the main loop */
+struct efm32x_bg_job {
+	struct flash_bank *bank;
+	enum efm32x_bg_state state;
+	struct efm32x_page_loader loader;
+	uint8_t *data;
+	uint8_t *ops;
+	uint32_t offset;
+	uint32_t count;
+	uint32_t done;
+	uint32_t page;
+	int64_t start_ms;
+	int64_t elapsed_ms;
+};
+
+static uint32_t efm32x_bg_rate(const struct efm32x_bg_job *job)
+{
+	if (job->elapsed_ms <= 0)
+		return 0;
+	return (uint32_t)((uint64_t)job->done * 1000 / job->elapsed_ms);
+}
+
+/* Invoke the Tcl event handler as "<handler> <event> <done> <total> <page> <rate>" */
+static void efm32x_bg_event(struct efm32x_flash_chip *efm32x_info,
+	const struct efm32x_bg_job *job, const char *event)
+{
+	if (!efm32x_info->bg_event_cmd || !efm32x_info->bg_interp)
+		return;
+
+	char *script = alloc_printf("%s %s %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32,
+		efm32x_info->bg_event_cmd, event, job->done, job->count, job->page,
+		efm32x_bg_rate(job));
+	if (!script)
+		return;
+
+	if (Jim_Eval(efm32x_info->bg_interp, script) != JIM_OK)
+		LOG_WARNING("background event handler failed: %s",
+			Jim_GetString(Jim_GetResult(efm32x_info->bg_interp), NULL));
+	free(script);
+}
+
+static int efm32x_bg_step(void *priv);
+
+/* Release the job's target resources and report its final state */
+static void efm32x_bg_finish(struct efm32x_bg_job *job, enum efm32x_bg_state state)
+{
+	struct flash_bank *bank = job->bank;
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	target_unregister_timer_callback(efm32x_bg_step, job);
+
+	/* working areas are gone if the target has been reset meanwhile */
+	if (job->loader.buf)
+		target_free_working_area(bank->target, job->loader.buf);
+	if (job->loader.code)
+		target_free_working_area(bank->target, job->loader.code);
+	job->loader.buf = NULL;
+	job->loader.code = NULL;
+
+	free(job->data);
+	free(job->ops);
+	job->data = NULL;
+	job->ops = NULL;
+
+	job->elapsed_ms = timeval_ms() - job->start_ms;
+	job->state = state;
+
+	LOG_INFO("background write %s: %" PRIu32 " of %" PRIu32 " bytes, %" PRId64 " ms",
+		efm32x_bg_state_names[state], job->done, job->count, job->elapsed_ms);
+	efm32x_bg_event(efm32x_info, job, efm32x_bg_state_names[state]);
+}
+
+/*
+ * Program the next page of the job; called periodically from the main loop.
+ * The target may be resumed between steps, so each step boosts the clock and
+ * unlocks the MSC for its own page only and restores both before returning.
+ */
+static int efm32x_bg_step(void *priv)
+{
+	struct efm32x_bg_job *job = priv;
+	struct flash_bank *bank = job->bank;
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t page_size = job->loader.page_size;
+
+	if (job->state != EFM32_BG_RUNNING)
+		return ERROR_OK;
+
+	if (bank->target->state != TARGET_HALTED || !job->loader.code || !job->loader.buf) {
+		LOG_ERROR("target left halt state during background write");
+		efm32x_bg_finish(job, EFM32_BG_FAILED);
+		return ERROR_OK;
+	}
+
+	uint32_t start = job->offset + job->done;
+	uint32_t end = (start / page_size + 1) * page_size;
+	if (end > job->offset + job->count)
+		end = job->offset + job->count;
+	job->page = start / page_size;
+
+	uint32_t ops_len = efm32x_page_encode(job->ops, job->data + job->done, NULL,
+		(start % page_size) / 4, (end - start) / 4);
+	int ret = efm32x_clock_boost(bank);
+	if (ret == ERROR_OK) {
+		efm32x_msc_lock(bank, 0);
+		ret = efm32x_set_wren(bank, 1);
+		if (ret == ERROR_OK)
+			ret = efm32x_page_loader_run(bank, &job->loader,
+				bank->base + job->page * page_size, job->ops, ops_len);
+		int ret2 = efm32x_set_wren(bank, 0);
+		efm32x_msc_lock(bank, 1);
+		if (ret == ERROR_OK)
+			ret = ret2;
+	}
+	int ret2 = efm32x_clock_restore(bank);
+	if (ret == ERROR_OK)
+		ret = ret2;
+	if (ret != ERROR_OK) {
+		efm32x_bg_finish(job, EFM32_BG_FAILED);
+		return ERROR_OK;
+	}
+
+	bank->sectors[job->page].is_erased = 0;
+	job->done += end - start;
+	job->elapsed_ms = timeval_ms() - job->start_ms;
+
+	if (job->done == job->count)
+		efm32x_bg_finish(job, EFM32_BG_DONE);
+	else
+		efm32x_bg_event(efm32x_info, job, "progress");
+
+	return ERROR_OK;
+}
+
+static void efm32x_bg_free(struct efm32x_flash_chip *efm32x_info)
+{
+	struct efm32x_bg_job *job = efm32x_info->bg_job;
+
+	if (job) {
+		target_unregister_timer_callback(efm32x_bg_step, job);
+		free(job->data);
+		free(job->ops);
+		free(job);
+	}
+	free(efm32x_info->bg_event_cmd);
+}
+
+static bool efm32x_bg_busy(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (efm32x_info->bg_job && efm32x_info->bg_job->state == EFM32_BG_RUNNING) {
+		LOG_ERROR("background write in progress");
+		return true;
+	}
+	return false;
+}
+
+/* Start programming data (count bytes, padded) at offset; takes ownership of data */
+static int efm32x_bg_start(struct flash_bank *bank, uint8_t *data,
+	uint32_t offset, uint32_t count)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t page_size = bank->sectors[0].size;
+	int ret;
+
+	struct efm32x_bg_job *job = efm32x_info->bg_job;
+	if (!job) {
+		job = calloc(1, sizeof(*job));
+		if (!job) {
+			free(data);
+			LOG_ERROR("no memory for background job");
+			return ERROR_FAIL;
+		}
+		efm32x_info->bg_job = job;
+	}
+
+	memset(job, 0, sizeof(*job));
+	job->bank = bank;
+	job->data = data;
+	job->offset = offset;
+	job->count = count;
+	job->page = offset / page_size;
+	job->state = EFM32_BG_FAILED;
+	job->ops = malloc(2 * page_size + 16);
+	if (!job->ops) {
+		free(job->data);
+		job->data = NULL;
+		LOG_ERROR("no memory for page op buffer");
+		return ERROR_FAIL;
+	}
+
+	ret = efm32x_page_loader_init(bank, &job->loader, page_size);
+	if (ret == ERROR_OK)
+		ret = target_register_timer_callback(efm32x_bg_step, 1,
+			TARGET_TIMER_TYPE_PERIODIC, job);
+
+	job->start_ms = timeval_ms();
+	if (ret != ERROR_OK) {
+		efm32x_bg_finish(job, EFM32_BG_FAILED);
+		return ret;
+	}
+
+	job->state = EFM32_BG_RUNNING;
+	return ERROR_OK;
+}
+
+static int efm32x_priv_probe(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct efm32_info *efm32_mcu_info = &(efm32x_info->info);
+	int ret;
+	uint32_t base_address = EFM32_FLASH_BASE;
+
+	int bank_index = efm32x_get_bank_index(bank->base);
+	assert(bank_index >= 0);
+
+	efm32x_info->probed[bank_index] = false;
+	memset(efm32x_info->lb_page, 0xff, LOCKWORDS_SZ);
+
+	/* the page layout may change, start the cache over */
+	bool cached = efm32x_info->cache[bank_index];
+	efm32x_cache_disable(bank);
+
+	ret = efm32x_read_info(bank);
+	if (ret != ERROR_OK)
+		return ret;
+
+	if (efm32_mcu_info->part_family_num == 23) {
+		base_address = EFM32_FLASH_BASE_G23;
+	}
+
+	if (bank->base == 0) bank->base = base_address;
+
+	assert(efm32_mcu_info->page_size != 0);
+
+	free(bank->sectors);
+	bank->sectors = NULL;
+
+	/* enable MSC clock */
+	uint32_t msc_clken = EFM32_CMU_REG_CLKEN1_MSC_MSK_G22;
+	if (efm32_mcu_info->part_family_num == 22) {
+		msc_clken = EFM32_CMU_REG_CLKEN1_MSC_MSK_G22;
+	} else if (efm32_mcu_info->part_family_num == 23) {
+		msc_clken = EFM32_CMU_REG_CLKEN1_MSC_MSK_G23;
+	} else {
+		LOG_WARNING("Don't know EFR/EFM Gx family number, can't set MSC register. Defaulting to EF{M,R}xG22 values..");
+	}
+
+	ret = target_write_u32(bank->target, EFM32_CMU_REGBASE + EFM32_CMU_REG_CLKEN1_SET, msc_clken);
+	if (ret != ERROR_OK) {
+		LOG_ERROR("Failed to enable MSC clock");
+		return ret;
+	}
+
+	uint16_t page_size;
+	if (bank->base == base_address) {
+		bank->num_sectors = efm32_mcu_info->flash_sz_kib * 1024 /
+			efm32_mcu_info->page_size;
+		assert(bank->num_sectors > 0);
+
+		ret = efm32x_read_lock_data(bank);
+		if (ret != ERROR_OK) {
+			LOG_ERROR("Failed to read LB data");
+			return ret;
+		}
+		page_size = efm32_mcu_info->page_size;
+	} else{
+		bank->num_sectors = 1;
+		page_size = 1024;
+	}
+	bank->size = bank->num_sectors * page_size;
+
+	LOG_INFO("detected part: %cG%d%c%03d, rev %d",
+	efm32_mcu_info->part_family,
+	efm32_mcu_info->part_family_num,
+	efm32_mcu_info->dev_num_letter,
+	efm32_mcu_info->dev_num_digits,
+	efm32_mcu_info->prod_rev);
+	LOG_INFO("flash size = %dbytes", bank->size);
+	LOG_INFO("flash page size = %dbytes", page_size);
+
+	bank->sectors = malloc(sizeof(struct flash_sector) * bank->num_sectors);
+	for (uint32_t i = 0; i < bank->num_sectors; i++) {
+		bank->sectors[i].offset = i * page_size;
+		bank->sectors[i].size = page_size;
+		bank->sectors[i].is_erased = -1;
+		bank->sectors[i].is_protected = 1;
+	}
+
+	efm32x_info->probed[bank_index] = true;
+
+	/* the manifest is read by the first flash operation that uses it */
+	if (bank_index == EFM32_BANK_INDEX_MAIN) {
+		efm32x_manifest_free(efm32x_info);
+		efm32x_info->manifest_loaded = false;
+	}
+
+	if (cached)
+		return efm32x_cache_enable(bank);
+	return ERROR_OK;
+}
+
+static int efm32x_probe(struct flash_bank *bank)
+{
+	struct efm32x_stats_mark mark;
+
+	efm32x_stats_begin(bank, &mark);
+	int ret = efm32x_priv_probe(bank);
+	efm32x_stats_end(bank, EFM32_OP_PROBE, &mark, 0);
+	return ret;
+}
+
+static int efm32x_auto_probe(struct flash_bank *bank)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	int bank_index = efm32x_get_bank_index(bank->base);
+	assert(bank_index >= 0);
+
+	if (efm32x_info->probed[bank_index])
+		return ERROR_OK;
+	return efm32x_probe(bank);
+}
+
+static int efm32x_priv_protect_check(struct flash_bank *bank)
+{
+	struct target *target = bank->target;
+	int ret = 0;
+
+	if (target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	ret = efm32x_read_lock_data(bank);
+	if (ret != ERROR_OK) {
+		LOG_ERROR("Failed to read LB data");
+		return ret;
+	}
+
+	assert(bank->sectors);
+
+	for (unsigned int i = 0; i < bank->num_sectors; i++)
+		bank->sectors[i].is_protected = efm32x_get_page_lock(bank, i);
+
+	return ERROR_OK;
+}
+
+static int efm32x_protect_check(struct flash_bank *bank)
+{
+	struct efm32x_stats_mark mark;
+
+	efm32x_stats_begin(bank, &mark);
+	int ret = efm32x_priv_protect_check(bank);
+	efm32x_stats_end(bank, EFM32_OP_PROTECT_CHECK, &mark, 0);
+	return ret;
+}
+
+static int get_efm32x_info(struct flash_bank *bank, struct command_invocation *cmd)
+{
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	int ret;
+
+	ret = efm32x_read_info(bank);
+	if (ret != ERROR_OK) {
+		LOG_ERROR("Failed to read EFM32 info");
+		return ret;
+	}
+
+	command_print_sameline(cmd, "%cG%d%c%03d, rev %d", efm32x_info->info.part_family, efm32x_info->info.part_family_num,
+		efm32x_info->info.dev_num_letter, efm32x_info->info.dev_num_digits, efm32x_info->info.prod_rev);
+	return ERROR_OK;
+}
+
+static int efm32x_ap_read(struct adiv5_ap *ap, uint32_t csw, uint32_t addr,
+	uint32_t *value)
+{
+	int ret = dap_queue_ap_write(ap, EFM32_AP_REG_CSW, csw);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_write(ap, EFM32_AP_REG_TAR, addr);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_read(ap, EFM32_AP_REG_DRW, value);
+	if (ret == ERROR_OK)
+		ret = dap_run(ap->dap);
+
+	/* keep the MEM-AP code from trusting its cached CSW and TAR */
+	dap_invalidate_cache(ap->dap);
+	return ret;
+}
+
+static int efm32x_ap_write(struct adiv5_ap *ap, uint32_t csw, uint32_t addr,
+	uint32_t value)
+{
+	int ret = dap_queue_ap_write(ap, EFM32_AP_REG_CSW, csw);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_write(ap, EFM32_AP_REG_TAR, addr);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_write(ap, EFM32_AP_REG_DRW, value);
+	if (ret == ERROR_OK)
+		ret = dap_run(ap->dap);
+
+	dap_invalidate_cache(ap->dap);
+	return ret;
+}
+
+/*
+ * Access a DCI register and read STATUS after it in the same DAP run, so
+ * the next word of an exchange rarely needs a poll of its own.
+ */
+static int efm32x_dci_access(struct adiv5_ap *ap, uint32_t reg, bool write,
+	uint32_t *value, uint32_t *status)
+{
+	int ret = dap_queue_ap_write(ap, EFM32_AP_REG_CSW, EFM32_DCI_CSW);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_write(ap, EFM32_AP_REG_TAR, reg);
+	if (ret == ERROR_OK)
+		ret = write ? dap_queue_ap_write(ap, EFM32_AP_REG_DRW, *value) :
+			dap_queue_ap_read(ap, EFM32_AP_REG_DRW, value);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_write(ap, EFM32_AP_REG_TAR, EFM32_DCI_REG_STATUS);
+	if (ret == ERROR_OK)
+		ret = dap_queue_ap_read(ap, EFM32_AP_REG_DRW, status);
+	if (ret == ERROR_OK)
+		ret = dap_run(ap->dap);
+
+	dap_invalidate_cache(ap->dap);
+	return ret;
+}
+
+/* status holds the DCI status of the previous access and is updated */
+static int efm32x_dci_write(struct adiv5_ap *ap, uint32_t word, uint32_t *status)
+{
+	int64_t then = timeval_ms();
+
+	for (;;) {
+		if (*status & EFM32_DCI_STATUS_RDATAVALID_MASK) {
+			LOG_ERROR("DCI has an unread response, can't write a command");
+			return ERROR_FAIL;
+		}
+		if (!(*status & EFM32_DCI_STATUS_WPENDING_MASK))
+			break;
+		if (timeval_ms() - then > EFM32_DCI_TMO) {
+			LOG_ERROR("DCI write timed out");
+			return ERROR_TIMEOUT_REACHED;
+		}
+		int ret = efm32x_ap_read(ap, EFM32_DCI_CSW, EFM32_DCI_REG_STATUS, status);
+		if (ret != ERROR_OK)
+			return ret;
+	}
+
+	return efm32x_dci_access(ap, EFM32_DCI_REG_WDATA, true, &word, status);
+}
+
+static int efm32x_dci_read(struct adiv5_ap *ap, uint32_t *word, uint32_t *status)
+{
+	int64_t then = timeval_ms();
+
+	while (!(*status & EFM32_DCI_STATUS_RDATAVALID_MASK)) {
+		if (timeval_ms() - then > EFM32_DCI_TMO) {
+			LOG_ERROR("DCI read timed out");
+			return ERROR_TIMEOUT_REACHED;
+		}
+		alive_sleep(1);
+		int ret = efm32x_ap_read(ap, EFM32_DCI_CSW, EFM32_DCI_REG_STATUS, status);
+		if (ret != ERROR_OK)
+			return ret;
+	}
+
+	return efm32x_dci_access(ap, EFM32_DCI_REG_RDATA, false, word, status);
+}
+
+/**
+ * Send a command without parameters to the Secure Engine through the DCI
+ * and read up to max_words words of its response into response.
+ * Returns the number of response words in n_words.
+ */
+static int efm32x_dci_command(struct adiv5_dap *dap, uint32_t command,
+	uint32_t *response, unsigned int max_words, unsigned int *n_words)
+{
+	struct adiv5_ap *ap = dap_get_ap(dap, EFM32_DCI_AP);
+	uint32_t id, len, status;
+	int ret;
+
+	if (!ap)
+		return ERROR_FAIL;
+
+	ret = efm32x_dci_access(ap, EFM32_DCI_REG_ID, false, &id, &status);
+	if (ret == ERROR_OK && id != EFM32_DCI_ID) {
+		LOG_ERROR("unexpected DCI id 0x%" PRIx32, id);
+		ret = ERROR_FAIL;
+	}
+	if (ret == ERROR_OK)
+		ret = efm32x_dci_write(ap, EFM32_SE_CMD_LEN, &status);
+	if (ret == ERROR_OK)
+		ret = efm32x_dci_write(ap, command, &status);
+	if (ret == ERROR_OK)
+		ret = efm32x_dci_read(ap, &len, &status);
+	if (ret == ERROR_OK && (len & 0xffff0000)) {
+		LOG_ERROR("SE command 0x%08" PRIx32 " failed, response 0x%08" PRIx32, command, len);
+		ret = ERROR_FAIL;
+	}
+
+	*n_words = 0;
+	/* the length word counts itself */
+	for (uint32_t i = 4; ret == ERROR_OK && i < len; i += 4) {
+		uint32_t word;
+		ret = efm32x_dci_read(ap, &word, &status);
+		if (ret == ERROR_OK && *n_words < max_words)
+			response[(*n_words)++] = word;
+	}
+
+	dap_put_ap(ap);
+	return ret;
+}
+
+/* Read the debug lock word of the SE status */
+static int efm32x_dci_debuglock(struct adiv5_dap *dap, uint32_t *debuglock)
+{
+	uint32_t status[16];
+	unsigned int n_words;
+
+	int ret = efm32x_dci_command(dap, EFM32_SE_CMD_READ_STATUS, status,
+		ARRAY_SIZE(status), &n_words);
+	if (ret != ERROR_OK)
+		return ret;
+
+	/* the debug lock word moved with the longer status of newer SE firmware */
+	unsigned int idx = n_words == 9 ? 7 : 3;
+	if (idx >= n_words) {
+		LOG_ERROR("SE status too short");
+		return ERROR_FAIL;
+	}
+
+	*debuglock = status[idx];
+	return ERROR_OK;
+}
+
+/*
+ * Have the SE apply the debug lock, which takes effect at the next reset.
+ * Skipped if its status shows the lock configured already; sent tells
+ * whether the command went out.
+ */
+static int efm32x_dci_apply_debuglock(struct adiv5_dap *dap, bool *sent)
+{
+	uint32_t debuglock;
+	unsigned int n_words;
+
+	*sent = false;
+	if (!dap) {
+		LOG_ERROR("the DCI needs a DAP, not available with HLA adapters");
+		return ERROR_FAIL;
+	}
+
+	int ret = efm32x_dci_debuglock(dap, &debuglock);
+	if (ret != ERROR_OK || (debuglock & EFM32_SE_STATUS_DEBUGLOCK))
+		return ret;
+
+	*sent = true;
+	return efm32x_dci_command(dap, EFM32_SE_CMD_APPLY_LOCK, NULL, 0, &n_words);
+}
+
+enum efm32x_attach_path {
+	EFM32_ATTACH_EXAMINE,
+	EFM32_ATTACH_RESET,
+	EFM32_ATTACH_DCI,
+	EFM32_ATTACH_N_PATHS
+};
+
+static const char * const efm32x_attach_path_names[] = {
+	[EFM32_ATTACH_EXAMINE] = "examine",
+	[EFM32_ATTACH_RESET] = "connect-under-reset",
+	[EFM32_ATTACH_DCI] = "dci",
+};
+
+static int efm32x_attach_halt(struct target *target)
+{
+	int ret = target_examine_one(target);
+	if (ret != ERROR_OK)
+		return ret;
+
+	ret = target_poll(target);
+	if (ret == ERROR_OK && target->state != TARGET_HALTED) {
+		ret = target_halt(target);
+		if (ret == ERROR_OK)
+			ret = target_wait_state(target, TARGET_HALTED, EFM32_ATTACH_HALT_TMO);
+	}
+
+	return ret;
+}
+
+/* Arm a halt on the next core reset through the AHB-AP */
+static int efm32x_attach_catch_reset(struct adiv5_dap *dap, bool sysresetreq)
+{
+	struct adiv5_ap *ap = dap_get_ap(dap, EFM32_AHB_AP);
+	if (!ap)
+		return ERROR_FAIL;
+
+	int ret = efm32x_ap_write(ap, EFM32_AHB_AP_CSW, DCB_DHCSR,
+		DBGKEY | C_DEBUGEN | C_HALT);
+	if (ret == ERROR_OK)
+		ret = efm32x_ap_write(ap, EFM32_AHB_AP_CSW, DCB_DEMCR, VC_CORERESET);
+	if (ret == ERROR_OK && sysresetreq)
+		ret = efm32x_ap_write(ap, EFM32_AHB_AP_CSW, NVIC_AIRCR,
+			AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+
+	dap_put_ap(ap);
+	return ret;
+}
+
+static int efm32x_attach_path(struct target *target, enum efm32x_attach_path path,
+	bool *locked)
+{
+	struct adiv5_dap *dap = target_to_armv7m(target)->arm.dap;
+	uint32_t debuglock;
+	int ret, ret2;
+
+	switch (path) {
+	case EFM32_ATTACH_EXAMINE:
+		ret = dap_dp_init(dap);
+		if (ret == ERROR_OK)
+			ret = efm32x_attach_halt(target);
+		return ret;
+
+	case EFM32_ATTACH_RESET:
+		if (!(jtag_get_reset_config() & RESET_HAS_SRST))
+			return ERROR_NOT_IMPLEMENTED;
+
+		ret = adapter_assert_reset();
+		if (ret != ERROR_OK)
+			return ret;
+		alive_sleep(EFM32_ATTACH_SRST_HOLD);
+		ret = dap_dp_init(dap);
+		if (ret == ERROR_OK)
+			ret = efm32x_attach_catch_reset(dap, false);
+		ret2 = adapter_deassert_reset();
+		if (ret == ERROR_OK)
+			ret = ret2;
+		break;
+
+	case EFM32_ATTACH_DCI:
+		/* the power-up request of the DP init wakes the device from EM2/EM3,
+		 * the SE tells whether there is any point in retrying */
+		ret = dap_dp_init(dap);
+		if (ret == ERROR_OK)
+			ret = efm32x_dci_debuglock(dap, &debuglock);
+		if (ret == ERROR_OK && (debuglock & EFM32_SE_STATUS_DEBUGLOCK_HW)) {
+			LOG_ERROR("debug interface is locked, only a device erase can recover it");
+			*locked = true;
+			return ERROR_FAIL;
+		}
+		if (ret == ERROR_OK)
+			ret = efm32x_attach_catch_reset(dap, true);
+		alive_sleep(EFM32_ATTACH_SRST_HOLD);
+		if (ret == ERROR_OK)
+			ret = dap_dp_init(dap);
+		break;
+
+	default:
+		return ERROR_FAIL;
+	}
+
+	if (ret == ERROR_OK)
+		ret = efm32x_attach_halt(target);
+
+	/* don't catch later resets */
+	uint32_t demcr;
+	if (ret == ERROR_OK)
+		ret = target_read_u32(target, DCB_DEMCR, &demcr);
+	if (ret == ERROR_OK)
+		ret = target_write_u32(target, DCB_DEMCR, demcr & ~VC_CORERESET);
+
+	return ret;
+}
+
+/**
+ * Get the core of a sleeping device halted, trying the attach paths from
+ * the cheapest to the most intrusive, up to retries rounds.
+ */
+static int efm32x_attach(struct target *target, unsigned int retries)
+{
+	int64_t start = timeval_ms();
+	bool locked = false;
+
+	for (unsigned int attempt = 1; attempt <= retries; attempt++) {
+		for (int path = 0; path < EFM32_ATTACH_N_PATHS; path++) {
+			int ret = efm32x_attach_path(target, path, &locked);
+			if (ret == ERROR_OK) {
+				LOG_INFO("attached via %s in %" PRId64 " ms, attempt %u",
+					efm32x_attach_path_names[path], timeval_ms() - start, attempt);
+				efm32x_cache_stale(target);
+				return ERROR_OK;
+			}
+			if (locked)
+				return ERROR_FAIL;
+			if (ret != ERROR_NOT_IMPLEMENTED)
+				LOG_DEBUG("attach via %s failed (%d)", efm32x_attach_path_names[path], ret);
+			keep_alive();
+		}
+	}
+
+	LOG_ERROR("failed to attach after %u attempts, %" PRId64 " ms", retries,
+		timeval_ms() - start);
+	return ERROR_FAIL;
+}
+
+COMMAND_HANDLER(efm32x_handle_attach_command)
+{
+	/* examining from here invokes the examine-fail handler again */
+	static bool attaching;
+	unsigned int retries = EFM32_ATTACH_RETRIES;
+
+	if (CMD_ARGC > 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (CMD_ARGC > 0)
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[0], retries);
+
+	if (attaching)
+		return ERROR_OK;
+
+	struct target *target = get_current_target(CMD_CTX);
+	if (target_to_cm(target)->common_magic != CORTEX_M_COMMON_MAGIC
+			|| !target_to_armv7m(target)->arm.dap) {
+		command_print(CMD, "target is not a Cortex-M with DAP access");
+		return ERROR_TARGET_INVALID;
+	}
+
+	attaching = true;
+	int retval = efm32x_attach(target, retries);
+	attaching = false;
+
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_debuglock_command)
+{
+	struct target *target = NULL;
+
+	if (CMD_ARGC < 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	target = bank->target;
+
+	/* series 2 keeps the debug lock in the SE, not in the lock bits page */
+	bool sent;
+	retval = efm32x_dci_apply_debuglock(target_to_armv7m(target)->arm.dap, &sent);
+	if (retval != ERROR_OK) {
+		LOG_ERROR("Failed to apply the debug lock");
+		return retval;
+	}
+
+	command_print(CMD, "efm32x debug interface %slocked, reset the device to apply",
+		sent ? "" : "already ");
+
+	return ERROR_OK;
+}
+
+/* lock page ranges of a finalize spec */
+#define EFM32_FINALIZE_MAX_LOCKS        16
+
+/*
+ * Apply a production spec in one pass: user data, page locks and the debug
+ * lock, each left alone if the device holds it already, then check all of
+ * it once and report pass or fail.
+ */
+COMMAND_HANDLER(efm32x_handle_finalize_command)
+{
+	const char *userdata = NULL;
+	uint32_t userdata_offset = 0;
+	unsigned int lock_first[EFM32_FINALIZE_MAX_LOCKS], lock_last[EFM32_FINALIZE_MAX_LOCKS];
+	unsigned int n_locks = 0, n_erases = 0, n_commands = 0;
+	bool debuglock = false;
+	uint8_t *want = NULL;
+
+	if (CMD_ARGC < 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (efm32x_get_bank_index(bank->base) != EFM32_BANK_INDEX_MAIN) {
+		command_print(CMD, "finalize takes the main flash bank, not flash bank %u",
+			bank->bank_number);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	for (unsigned int i = 1; i < CMD_ARGC; i++) {
+		if (!strcmp(CMD_ARGV[i], "lock") && n_locks == EFM32_FINALIZE_MAX_LOCKS) {
+			command_print(CMD, "at most %d lock ranges per finalize",
+				EFM32_FINALIZE_MAX_LOCKS);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		} else if (!strcmp(CMD_ARGV[i], "userdata") && i + 1 < CMD_ARGC) {
+			userdata = CMD_ARGV[++i];
+			if (i + 1 < CMD_ARGC && CMD_ARGV[i + 1][0] >= '0' && CMD_ARGV[i + 1][0] <= '9')
+				COMMAND_PARSE_NUMBER(u32, CMD_ARGV[++i], userdata_offset);
+		} else if (!strcmp(CMD_ARGV[i], "lock") && i + 2 < CMD_ARGC) {
+			COMMAND_PARSE_NUMBER(uint, CMD_ARGV[i + 1], lock_first[n_locks]);
+			COMMAND_PARSE_NUMBER(uint, CMD_ARGV[i + 2], lock_last[n_locks]);
+			if (lock_first[n_locks] > lock_last[n_locks]
+					|| lock_last[n_locks] >= bank->num_sectors) {
+				command_print(CMD, "invalid page range %s %s", CMD_ARGV[i + 1], CMD_ARGV[i + 2]);
+				return ERROR_COMMAND_ARGUMENT_INVALID;
+			}
+			n_locks++;
+			i += 2;
+		} else if (!strcmp(CMD_ARGV[i], "debuglock")) {
+			debuglock = true;
+		} else {
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		}
+	}
+
+	struct target *target = bank->target;
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	struct adiv5_dap *dap = target_to_armv7m(target)->arm.dap;
+
+	if (target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	/* the user data page as it should end up */
+	uint32_t want_crc = 0;
+	if (userdata) {
+		uint8_t *data;
+		size_t size;
+
+		retval = efm32x_read_file(userdata, &data, &size);
+		if (retval != ERROR_OK)
+			return retval;
+		if (userdata_offset > EFM32_USER_DATA_SZ || size > EFM32_USER_DATA_SZ - userdata_offset) {
+			LOG_ERROR("%s does not fit into user data at offset 0x%" PRIx32,
+				userdata, userdata_offset);
+			free(data);
+			return ERROR_FLASH_DST_OUT_OF_BANK;
+		}
+
+		want = malloc(EFM32_USER_DATA_SZ);
+		if (!want) {
+			free(data);
+			LOG_ERROR("Out of memory");
+			return ERROR_FAIL;
+		}
+		retval = target_read_buffer(target, EFM32_MSC_USER_DATA, EFM32_USER_DATA_SZ, want);
+		if (retval == ERROR_OK) {
+			memcpy(want + userdata_offset, data, size);
+			retval = image_calculate_checksum(want, EFM32_USER_DATA_SZ, &want_crc);
+		}
+		free(data);
+		if (retval == ERROR_OK)
+			retval = efm32x_update_page(bank, EFM32_MSC_USER_DATA, EFM32_USER_DATA_SZ,
+				want, false, &n_erases);
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Failed to write user data");
+			goto cleanup;
+		}
+	}
+
+	/* page locks, on top of those set already */
+	uint32_t want_lb[LOCKWORDS_SZ / 4];
+	if (n_locks) {
+		retval = efm32x_read_lock_data(bank);
+		if (retval != ERROR_OK)
+			goto cleanup;
+		for (unsigned int i = 0; retval == ERROR_OK && i < n_locks; i++) {
+			for (unsigned int page = lock_first[i]; retval == ERROR_OK && page <= lock_last[i]; page++)
+				retval = efm32x_set_page_lock(bank, page, 1);
+		}
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Failed to set page locks");
+			goto cleanup;
+		}
+		memcpy(want_lb, efm32x_info->lb_page, sizeof(want_lb));
+		retval = efm32x_write_lock_data(bank, &n_erases);
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Failed to write LB page");
+			goto cleanup;
+		}
+	}
+
+	/* last, so nothing above runs into a locked device */
+	if (debuglock) {
+		bool sent;
+		retval = efm32x_dci_apply_debuglock(dap, &sent);
+		if (retval != ERROR_OK) {
+			LOG_ERROR("Failed to apply the debug lock");
+			goto cleanup;
+		}
+		n_commands += sent;
+	}
+
+	/* one check of everything the spec asks for */
+	bool pass = true;
+	if (userdata) {
+		uint32_t crc;
+		retval = target_checksum_memory(target, EFM32_MSC_USER_DATA, EFM32_USER_DATA_SZ, &crc);
+		if (retval != ERROR_OK)
+			goto cleanup;
+		command_print(CMD, "user data: %s", crc == want_crc ? "ok" : "mismatch");
+		pass &= crc == want_crc;
+	}
+	if (n_locks) {
+		retval = efm32x_read_lock_data(bank);
+		if (retval != ERROR_OK)
+			goto cleanup;
+		bool locked = true;
+		for (unsigned int page = 0; page < bank->num_sectors; page++)
+			locked &= efm32x_get_page_lock(bank, page) ==
+				!(want_lb[page >> 5] & (1u << (page & 0x1f)));
+		command_print(CMD, "page locks: %s", locked ? "ok" : "mismatch");
+		pass &= locked;
+	}
+	if (debuglock) {
+		uint32_t status;
+		retval = efm32x_dci_debuglock(dap, &status);
+		if (retval != ERROR_OK)
+			goto cleanup;
+		bool locked = status & EFM32_SE_STATUS_DEBUGLOCK;
+		command_print(CMD, "debug lock: %s", locked ? "ok" : "not set");
+		pass &= locked;
+	}
+
+	command_print(CMD, "finalize %s, %u page erases, %u SE commands",
+		pass ? "pass" : "FAIL", n_erases, n_commands);
+	if (!pass)
+		retval = ERROR_FAIL;
+
+cleanup:
+	free(want);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_delta_write_command)
+{
+	uint32_t offset = 0;
+	uint8_t *data = NULL, *ref = NULL;
+	size_t data_size, ref_size;
+
+	if (CMD_ARGC < 3 || CMD_ARGC > 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (CMD_ARGC > 3)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[3], offset);
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	if (offset & 0x3) {
+		LOG_ERROR("offset 0x%" PRIx32 " breaks required 4-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+	}
+
+	retval = efm32x_read_file(CMD_ARGV[1], &data, &data_size);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_read_file(CMD_ARGV[2], &ref, &ref_size);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	if (data_size == 0 || offset + data_size > bank->size) {
+		LOG_ERROR("image does not fit into bank at offset 0x%" PRIx32, offset);
+		retval = ERROR_FLASH_DST_OUT_OF_BANK;
+		goto cleanup;
+	}
+	if (ref_size > bank->size - offset)
+		ref_size = bank->size - offset;
+
+	/* only trust the reference if the device still holds it */
+	uint32_t ref_crc, dev_crc;
+	retval = image_calculate_checksum(ref, ref_size, &ref_crc);
+	if (retval == ERROR_OK)
+		retval = target_checksum_memory(bank->target, bank->base + offset,
+			ref_size, &dev_crc);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	if (ref_crc != dev_crc) {
+		LOG_WARNING("flash contents do not match %s, sending full pages", CMD_ARGV[2]);
+		free(ref);
+		ref = NULL;
+		ref_size = 0;
+	}
+
+	retval = efm32x_delta_write(bank, data, ref, ref_size & ~3, offset,
+		(data_size + 3) & ~3, CMD);
+
+cleanup:
+	free(ref);
+	free(data);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_verify_pages_command)
+{
+	uint32_t offset = 0;
+	uint8_t *data = NULL;
+	unsigned int *bad = NULL;
+	size_t data_size;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], offset);
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	retval = efm32x_read_file(CMD_ARGV[1], &data, &data_size);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (data_size == 0 || offset > bank->size || data_size > bank->size - offset) {
+		LOG_ERROR("image does not fit into bank at offset 0x%" PRIx32, offset);
+		retval = ERROR_FLASH_DST_OUT_OF_BANK;
+		goto cleanup;
+	}
+
+	bad = malloc(bank->num_sectors * sizeof(*bad));
+	if (!bad) {
+		LOG_ERROR("Out of memory");
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+
+	unsigned int n_bad, n_sums;
+	retval = efm32x_tree_verify(bank, data, offset, data_size, bad, &n_bad, &n_sums);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	for (unsigned int i = 0; i < n_bad; i++)
+		command_print(CMD, "page %u at " TARGET_ADDR_FMT " differs", bad[i],
+			bank->base + bank->sectors[bad[i]].offset);
+	command_print(CMD, "%u pages differ, found with %u checksums", n_bad, n_sums);
+	if (n_bad)
+		retval = ERROR_FAIL;
+
+cleanup:
+	free(bad);
+	free(data);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_write_file_command)
+{
+	uint32_t offset = 0;
+	struct efm32x_file_map map;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], offset);
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	if (offset & 0x3) {
+		LOG_ERROR("offset 0x%" PRIx32 " breaks required 4-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+	}
+
+	if (bank->base == EFM32_MSC_LOCK_BITS) {
+		LOG_ERROR("Cannot write to lock words");
+		return ERROR_FAIL;
+	}
+
+	retval = efm32x_map_file(CMD_ARGV[1], &map);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (offset + map.size > bank->size) {
+		LOG_ERROR("image does not fit into bank at offset 0x%" PRIx32, offset);
+		retval = ERROR_FLASH_DST_OUT_OF_BANK;
+		goto cleanup;
+	}
+
+	uint32_t page_size = bank->sectors[0].size;
+	unsigned int first = offset / page_size;
+	unsigned int last = (offset + map.size - 1) / page_size;
+	int64_t start_ms = timeval_ms();
+
+	/* the loader erases every page it enters, so it only gets the pages the
+	 * file covers entirely; the others keep what lies outside the file */
+	uint32_t mid_start = (offset + page_size - 1) / page_size * page_size;
+	uint32_t mid_end = (offset + map.size) / page_size * page_size;
+	unsigned int edges[2] = { first, last };
+	for (unsigned int i = 0; i < 2; i++) {
+		unsigned int page = edges[i];
+		uint32_t page_offset = bank->sectors[page].offset;
+		if ((i == 1 && page == first)
+				|| (page_offset >= mid_start && page_offset + page_size <= mid_end))
+			continue;
+
+		uint32_t start = page == first ? offset - page_offset : 0;
+		uint32_t end = page == last ? offset + map.size - page_offset : page_size;
+		uint8_t *merged = malloc(page_size);
+		if (!merged) {
+			LOG_ERROR("Out of memory");
+			retval = ERROR_FAIL;
+			goto cleanup;
+		}
+		retval = target_read_buffer(bank->target, bank->base + page_offset, page_size, merged);
+		if (retval == ERROR_OK) {
+			memcpy(merged + start, map.data + page_offset + start - offset, end - start);
+			retval = efm32x_update_page(bank, bank->base + page_offset, page_size, merged,
+				false, NULL);
+		}
+		free(merged);
+		if (retval != ERROR_OK)
+			goto cleanup;
+	}
+
+	if (mid_start < mid_end) {
+		retval = efm32x_priv_write(bank, map.data + mid_start - offset, bank->base + mid_start,
+			mid_end - mid_start, EFM32_LOADER_ERASE);
+		if (retval != ERROR_OK)
+			goto cleanup;
+	}
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	for (unsigned int page = first; page <= last; page++) {
+		uint32_t start = page == first ? offset - bank->sectors[page].offset : 0;
+		uint32_t end = page == last ? offset + map.size - bank->sectors[page].offset : page_size;
+		uint32_t crc;
+
+		bank->sectors[page].is_erased = 0;
+		retval = image_calculate_checksum(map.data + bank->sectors[page].offset + start - offset,
+			end - start, &crc);
+		if (retval != ERROR_OK)
+			goto cleanup;
+		efm32x_journal_record(bank, page, efm32x_info->write_verified ?
+			EFM32_JOURNAL_VERIFIED : EFM32_JOURNAL_PROGRAMMED, start, end - start, crc);
+	}
+
+	if (efm32x_get_bank_index(bank->base) == EFM32_BANK_INDEX_MAIN
+			&& efm32x_manifest_location(bank)) {
+		/* pages the file covers entirely hold just the file, the target
+		 * checksums the merged ones at the edges */
+		uint32_t *crc = malloc((last - first + 1) * sizeof(*crc));
+		retval = ERROR_FAIL;
+		if (!crc)
+			LOG_ERROR("no memory for page CRCs");
+		for (unsigned int page = first; crc && page <= last; page++) {
+			uint32_t page_offset = bank->sectors[page].offset;
+			if (page_offset >= mid_start && page_offset + page_size <= mid_end)
+				retval = image_calculate_checksum(map.data + page_offset - offset, page_size,
+					&crc[page - first]);
+			else
+				retval = target_checksum_memory(bank->target, bank->base + page_offset,
+					page_size, &crc[page - first]);
+			if (retval != ERROR_OK)
+				break;
+		}
+		if (retval == ERROR_OK)
+			retval = efm32x_manifest_write(bank, bank->base + first * page_size,
+				last - first + 1, crc);
+		free(crc);
+		if (retval != ERROR_OK)
+			goto cleanup;
+	}
+
+	command_print(CMD, "wrote %zu bytes from file %s to flash bank %u at offset 0x%8.8"
+		PRIx32 " in %" PRId64 " ms", map.size, CMD_ARGV[1], bank->bank_number,
+		offset, timeval_ms() - start_ms);
+
+cleanup:
+	efm32x_unmap_file(&map);
+	return retval;
+}
+
+/* the sections of an image in one bank, as word aligned runs */
+struct efm32x_image_runs {
+	/* bank sized, 0xff outside the sections */
+	uint8_t *data;
+	struct efm32x_run *runs;
+	unsigned int n_runs;
+	unsigned int n_sections;
+	uint32_t n_bytes;
+};
+
+static void efm32x_free_image_runs(struct efm32x_image_runs *ir)
+{
+	free(ir->runs);
+	free(ir->data);
+	ir->runs = NULL;
+	ir->data = NULL;
+}
+
+/* Read the sections of image falling into bank and merge them into runs */
+static int efm32x_load_image_runs(struct flash_bank *bank, struct image *image,
+	struct efm32x_image_runs *ir)
+{
+	uint32_t n_words = bank->size / 4;
+	uint8_t *covered = calloc(n_words, 1);
+	int ret = ERROR_OK;
+
+	memset(ir, 0, sizeof(*ir));
+	ir->data = malloc(bank->size);
+	/* runs alternate with gaps, so there are at most half as many as words */
+	ir->runs = malloc((n_words / 2 + 1) * sizeof(*ir->runs));
+	if (!ir->data || !covered || !ir->runs) {
+		LOG_ERROR("no memory for image runs");
+		ret = ERROR_FAIL;
+		goto cleanup;
+	}
+	memset(ir->data, 0xff, bank->size);
+
+	for (unsigned int i = 0; i < image->num_sections; i++) {
+		target_addr_t start = image->sections[i].base_address;
+		target_addr_t end = start + image->sections[i].size;
+		size_t size_read;
+
+		if (start < bank->base)
+			start = bank->base;
+		if (end > bank->base + bank->size)
+			end = bank->base + bank->size;
+		if (start >= end)
+			continue;
+
+		ret = image_read_section(image, i, start - image->sections[i].base_address,
+			end - start, ir->data + (start - bank->base), &size_read);
+		if (ret == ERROR_OK && size_read != end - start)
+			ret = ERROR_FAIL;
+		if (ret != ERROR_OK)
+			goto cleanup;
+
+		/* sections sharing a word end up in the same run */
+		memset(covered + (start - bank->base) / 4, 1,
+			(end - bank->base + 3) / 4 - (start - bank->base) / 4);
+		ir->n_sections++;
+	}
+
+	for (uint32_t word = 0; word < n_words; ) {
+		if (!covered[word]) {
+			word++;
+			continue;
+		}
+		uint32_t end = word;
+		while (end < n_words && covered[end])
+			end++;
+		ir->runs[ir->n_runs].addr = bank->base + word * 4;
+		ir->runs[ir->n_runs].data = ir->data + word * 4;
+		ir->runs[ir->n_runs].len = (end - word) * 4;
+		ir->n_bytes += (end - word) * 4;
+		ir->n_runs++;
+		word = end;
+	}
+
+cleanup:
+	free(covered);
+	if (ret != ERROR_OK)
+		efm32x_free_image_runs(ir);
+	return ret;
+}
+
+/* first page of run i not already touched by run i - 1, and its last page */
+static void efm32x_run_pages(struct flash_bank *bank, const struct efm32x_run *runs,
+	unsigned int i, unsigned int *first, unsigned int *last)
+{
+	uint32_t page_size = bank->sectors[0].size;
+
+	*first = (runs[i].addr - bank->base) / page_size;
+	*last = (runs[i].addr - bank->base + runs[i].len - 1) / page_size;
+	if (i > 0 && *first == (runs[i - 1].addr - bank->base + runs[i - 1].len - 1) / page_size)
+		(*first)++;
+}
+
+/*
+ * CRC of each page from first to last once the image is programmed: pages
+ * it touches are erased and hold its data, the others keep their contents,
+ * known from the manifest or checksummed on the target.
+ */
+static int efm32x_image_page_crcs(struct flash_bank *bank,
+	const struct efm32x_image_runs *ir, const struct efm32x_manifest *manifest,
+	unsigned int first, unsigned int last, uint32_t *crc, bool *touched)
+{
+	uint32_t page_size = bank->sectors[0].size;
+
+	memset(touched, 0, (last - first + 1) * sizeof(*touched));
+	for (unsigned int i = 0; i < ir->n_runs; i++) {
+		unsigned int run_first = (ir->runs[i].addr - bank->base) / page_size;
+		unsigned int run_last = (ir->runs[i].addr - bank->base + ir->runs[i].len - 1) / page_size;
+		for (unsigned int page = run_first; page <= run_last; page++)
+			touched[page - first] = true;
+	}
+
+	for (unsigned int page = first; page <= last; page++) {
+		uint32_t addr = bank->base + page * page_size;
+		int ret = ERROR_OK;
+
+		if (touched[page - first])
+			ret = image_calculate_checksum(ir->data + page * page_size, page_size,
+				&crc[page - first]);
+		else if (!efm32x_manifest_lookup(manifest, addr, &crc[page - first]))
+			ret = target_checksum_memory(bank->target, addr, page_size, &crc[page - first]);
+		if (ret != ERROR_OK)
+			return ret;
+	}
+
+	return ERROR_OK;
+}
+
+/* Leave out the parts of the runs in the pages from first marked in skip */
+static int efm32x_drop_run_pages(struct flash_bank *bank, struct efm32x_image_runs *ir,
+	unsigned int first, const bool *skip)
+{
+	uint32_t page_size = bank->sectors[0].size;
+	/* every page boundary may split a run */
+	struct efm32x_run *runs = malloc((ir->n_runs + bank->num_sectors) * sizeof(*runs));
+	unsigned int n_runs = 0;
+
+	if (!runs) {
+		LOG_ERROR("no memory for image runs");
+		return ERROR_FAIL;
+	}
+
+	ir->n_bytes = 0;
+	for (unsigned int i = 0; i < ir->n_runs; i++) {
+		uint32_t addr = ir->runs[i].addr;
+		uint32_t end = addr + ir->runs[i].len;
+
+		while (addr < end) {
+			unsigned int page = (addr - bank->base) / page_size;
+			uint32_t page_end = bank->base + (page + 1) * page_size;
+			uint32_t next = end < page_end ? end : page_end;
+
+			if (!skip[page - first]) {
+				if (n_runs > 0 && runs[n_runs - 1].addr + runs[n_runs - 1].len == addr) {
+					runs[n_runs - 1].len += next - addr;
+				} else {
+					runs[n_runs].addr = addr;
+					runs[n_runs].data = ir->data + (addr - bank->base);
+					runs[n_runs].len = next - addr;
+					n_runs++;
+				}
+				ir->n_bytes += next - addr;
+			}
+			addr = next;
+		}
+	}
+
+	free(ir->runs);
+	ir->runs = runs;
+	ir->n_runs = n_runs;
+	return ERROR_OK;
+}
+
+/* Program all sections of an image in the bank with one loader run */
+COMMAND_HANDLER(efm32x_handle_write_image_command)
+{
+	struct image image;
+	struct efm32x_image_runs ir;
+	uint32_t *crc = NULL;
+	bool *skip = NULL;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	if (bank->base == EFM32_MSC_LOCK_BITS) {
+		LOG_ERROR("Cannot write to lock words");
+		return ERROR_FAIL;
+	}
+
+	image.base_address_set = false;
+	image.base_address = 0;
+	image.start_address_set = false;
+	if (CMD_ARGC > 2) {
+		image.base_address_set = true;
+		COMMAND_PARSE_NUMBER(llong, CMD_ARGV[2], image.base_address);
+	}
+
+	retval = image_open(&image, CMD_ARGV[1], CMD_ARGC > 3 ? CMD_ARGV[3] : NULL);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_load_image_runs(bank, &image, &ir);
+	image_close(&image);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (ir.n_runs == 0) {
+		command_print(CMD, "no section of %s falls into flash bank %u", CMD_ARGV[1],
+			bank->bank_number);
+		goto cleanup;
+	}
+
+	int64_t start_ms = timeval_ms();
+
+	/* with a page manifest, leave out the pages already holding the image */
+	uint32_t page_size = bank->sectors[0].size;
+	const struct efm32x_run *last_run = &ir.runs[ir.n_runs - 1];
+	unsigned int first_page = (ir.runs[0].addr - bank->base) / page_size;
+	unsigned int last_page = (last_run->addr + last_run->len - 1 - bank->base) / page_size;
+	unsigned int n_span = last_page - first_page + 1, n_skipped = 0;
+
+	if (efm32x_get_bank_index(bank->base) == EFM32_BANK_INDEX_MAIN
+			&& efm32x_manifest_location(bank)) {
+		struct efm32x_manifest *manifest = efm32x_manifest_check(bank);
+
+		crc = malloc(n_span * sizeof(*crc));
+		skip = malloc(n_span * sizeof(*skip));
+		if (!crc || !skip) {
+			LOG_ERROR("no memory for page CRCs");
+			retval = ERROR_FAIL;
+			goto cleanup;
+		}
+		retval = efm32x_image_page_crcs(bank, &ir, manifest, first_page, last_page,
+			crc, skip);
+		if (retval != ERROR_OK)
+			goto cleanup;
+
+		for (unsigned int i = 0; i < n_span; i++) {
+			uint32_t old;
+			skip[i] = skip[i] && efm32x_manifest_lookup(manifest,
+				bank->base + (first_page + i) * page_size, &old) && old == crc[i];
+			n_skipped += skip[i];
+		}
+		if (n_skipped)
+			retval = efm32x_drop_run_pages(bank, &ir, first_page, skip);
+		if (retval != ERROR_OK)
+			goto cleanup;
+	}
+
+	/* erase the pages the runs touch, consecutive pages in one call */
+	for (unsigned int i = 0; i < ir.n_runs; i++) {
+		unsigned int first, last;
+		efm32x_run_pages(bank, ir.runs, i, &first, &last);
+		if (first <= last) {
+			retval = efm32x_erase(bank, first, last);
+			if (retval != ERROR_OK)
+				goto cleanup;
+		}
+		for (unsigned int page = first; page <= last; page++)
+			bank->sectors[page].is_erased = 0;
+	}
+
+	retval = efm32x_priv_write_runs(bank, ir.runs, ir.n_runs);
+	if (retval == ERROR_OK && crc)
+		retval = efm32x_manifest_write(bank, bank->base + first_page * page_size, n_span, crc);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	command_print(CMD, "wrote %" PRIu32 " bytes from %u sections of %s as %u runs in "
+		"one loader run, %" PRId64 " ms", ir.n_bytes, ir.n_sections, CMD_ARGV[1],
+		ir.n_runs, timeval_ms() - start_ms);
+	if (n_skipped)
+		command_print(CMD, "%u pages already up to date according to the page manifest",
+			n_skipped);
+
+cleanup:
+	free(skip);
+	free(crc);
+	efm32x_free_image_runs(&ir);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_pack_command)
+{
+	struct image image;
+	uint8_t family;
+	uint32_t page_size, flash_kib;
+
+	if (CMD_ARGC < 5 || CMD_ARGC > 7)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	COMMAND_PARSE_NUMBER(u8, CMD_ARGV[2], family);
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[3], page_size);
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[4], flash_kib);
+
+	if (page_size != 2048 && page_size != 4096 && page_size != 8192) {
+		command_print(CMD, "invalid page size %" PRIu32, page_size);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	image.base_address_set = false;
+	image.base_address = 0;
+	image.start_address_set = false;
+	if (CMD_ARGC > 5) {
+		image.base_address_set = true;
+		COMMAND_PARSE_NUMBER(llong, CMD_ARGV[5], image.base_address);
+	}
+
+	int retval = image_open(&image, CMD_ARGV[1], CMD_ARGC > 6 ? CMD_ARGV[6] : NULL);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_pkg_build(CMD_ARGV[0], &image, family, page_size, flash_kib, CMD);
+	image_close(&image);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_write_package_command)
+{
+	struct efm32x_file_map map;
+	struct efm32x_pkg pkg;
+	bool force = false;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (CMD_ARGC > 2) {
+		if (strcmp(CMD_ARGV[2], "force"))
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		force = true;
+	}
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	retval = efm32x_map_file(CMD_ARGV[1], &map);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_pkg_parse(&pkg, map.data, map.size);
+	if (retval == ERROR_OK)
+		retval = efm32x_pkg_write(bank, &pkg, force, CMD);
+
+	efm32x_unmap_file(&map);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_snapshot_command)
+{
+	if (CMD_ARGC != 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	return efm32x_snap_save(bank, CMD_ARGV[1], CMD);
+}
+
+COMMAND_HANDLER(efm32x_handle_restore_command)
+{
+	struct efm32x_file_map map;
+	struct efm32x_snap snap;
+	bool force = false;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (CMD_ARGC > 2) {
+		if (strcmp(CMD_ARGV[2], "force"))
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		force = true;
+	}
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	retval = efm32x_map_file(CMD_ARGV[1], &map);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_snap_parse(&snap, map.data, map.size);
+	if (retval == ERROR_OK)
+		retval = efm32x_snap_restore(bank, &snap, force, CMD);
+
+	efm32x_unmap_file(&map);
+	return retval;
+}
+
+COMMAND_HANDLER(efm32x_handle_clock_boost_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct efm32_info *info = &efm32x_info->info;
+
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], efm32x_info->clock_boost);
+
+	if (efm32x_info->clock_boost && (!info->clock_data || !info->boost_cal))
+		LOG_WARNING("no clock boost data for this part, running at default clock");
+
+	if (efm32x_info->clock_boost && info->clock_data && info->boost_cal)
+		command_print(CMD, "clock boost on, %d MHz", info->clock_data->mhz);
+	else
+		command_print(CMD, "clock boost %s", efm32x_info->clock_boost ? "on" : "off");
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_bg_write_command)
+{
+	uint32_t offset = 0;
+	uint8_t *data;
+	size_t data_size;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], offset);
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	if (offset & 0x3) {
+		LOG_ERROR("offset 0x%" PRIx32 " breaks required 4-byte alignment", offset);
+		return ERROR_FLASH_DST_BREAKS_ALIGNMENT;
+	}
+
+	retval = efm32x_read_file(CMD_ARGV[1], &data, &data_size);
+	if (retval != ERROR_OK)
+		return retval;
+
+	if (data_size == 0 || offset + data_size > bank->size) {
+		LOG_ERROR("image does not fit into bank at offset 0x%" PRIx32, offset);
+		free(data);
+		return ERROR_FLASH_DST_OUT_OF_BANK;
+	}
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	efm32x_info->bg_interp = CMD_CTX->interp;
+
+	return efm32x_bg_start(bank, data, offset, (data_size + 3) & ~3);
+}
+
+COMMAND_HANDLER(efm32x_handle_bg_status_command)
+{
+	if (CMD_ARGC != 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct efm32x_bg_job *job = efm32x_info->bg_job;
+	if (!job) {
+		command_print(CMD, "idle");
+		return ERROR_OK;
+	}
+
+	command_print(CMD, "%s %" PRIu32 " %" PRIu32 " %" PRIu32 " %" PRIu32,
+		efm32x_bg_state_names[job->state], job->done, job->count, job->page,
+		efm32x_bg_rate(job));
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_bg_cancel_command)
+{
+	if (CMD_ARGC != 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (efm32x_info->bg_job && efm32x_info->bg_job->state == EFM32_BG_RUNNING)
+		efm32x_bg_finish(efm32x_info->bg_job, EFM32_BG_CANCELLED);
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_bg_event_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (CMD_ARGC > 1) {
+		free(efm32x_info->bg_event_cmd);
+		efm32x_info->bg_event_cmd = NULL;
+		if (CMD_ARGV[1][0])
+			efm32x_info->bg_event_cmd = strdup(CMD_ARGV[1]);
+		efm32x_info->bg_interp = CMD_CTX->interp;
+	}
+
+	if (efm32x_info->bg_event_cmd)
+		command_print(CMD, "%s", efm32x_info->bg_event_cmd);
+	return ERROR_OK;
+}
+
+static int efm32x_set_core_reg(struct target *target, const char *name, uint32_t value)
+{
+	struct reg *reg = register_get_by_name(target->reg_cache, name, true);
+	uint8_t buf[4];
+
+	if (!reg) {
+		LOG_ERROR("no %s register", name);
+		return ERROR_FAIL;
+	}
+
+	buf_set_u32(buf, 0, 32, value);
+	return reg->type->set(reg, buf);
+}
+
+/* Load the sections of image into RAM, return the lowest address loaded */
+static int efm32x_ramrun_load(struct target *target, struct image *image,
+	uint32_t ram_end, uint32_t *lowest)
+{
+	*lowest = ram_end;
+
+	for (unsigned int i = 0; i < image->num_sections; i++) {
+		target_addr_t start = image->sections[i].base_address;
+		uint32_t size = image->sections[i].size;
+		size_t size_read;
+
+		if (start < EFM32_RAM_BASE || start + size > ram_end) {
+			LOG_ERROR("section at 0x%8.8" TARGET_PRIxADDR " does not fit into RAM "
+				"0x%8.8" PRIx32 "-0x%8.8" PRIx32, start, EFM32_RAM_BASE, ram_end);
+			return ERROR_FAIL;
+		}
+
+		uint8_t *data = malloc(size);
+		if (!data) {
+			LOG_ERROR("no memory for section %u", i);
+			return ERROR_FAIL;
+		}
+
+		int ret = image_read_section(image, i, 0, size, data, &size_read);
+		if (ret == ERROR_OK && size_read != size)
+			ret = ERROR_FAIL;
+		if (ret == ERROR_OK)
+			ret = target_write_buffer(target, start, size, data);
+		free(data);
+		if (ret != ERROR_OK)
+			return ret;
+
+		if (start < *lowest)
+			*lowest = start;
+	}
+
+	return ERROR_OK;
+}
+
+/**
+ * Start the image loaded with its vector table at vectors, as the core
+ * would from reset, and wait until it posts a non-zero result to mailbox.
+ * The core is halted again afterwards.
+ */
+static int efm32x_ramrun(struct target *target, uint32_t vectors, uint32_t ram_end,
+	uint32_t mailbox, unsigned int timeout_ms, uint32_t *result)
+{
+	uint32_t sp, entry;
+	int ret, ret2;
+
+	ret = target_read_u32(target, vectors, &sp);
+	if (ret == ERROR_OK)
+		ret = target_read_u32(target, vectors + 4, &entry);
+	if (ret != ERROR_OK)
+		return ret;
+
+	if (sp <= EFM32_RAM_BASE || sp > ram_end || (sp & 0x7)) {
+		LOG_WARNING("initial stack pointer 0x%8.8" PRIx32 " outside RAM, using 0x%8.8"
+			PRIx32, sp, ram_end);
+		sp = ram_end;
+	}
+
+	ret = target_write_u32(target, mailbox, 0);
+	if (ret == ERROR_OK)
+		ret = target_write_u32(target, EFM32_SCB_VTOR, vectors);
+	if (ret == ERROR_OK)
+		ret = efm32x_set_core_reg(target, "msp", sp);
+	if (ret == ERROR_OK)
+		ret = efm32x_set_core_reg(target, "sp", sp);
+	if (ret == ERROR_OK)
+		ret = target_resume(target, 0, entry & ~1, 0, 0);
+	if (ret != ERROR_OK)
+		return ret;
+
+	int64_t start = timeval_ms();
+	*result = 0;
+	while (1) {
+		alive_sleep(EFM32_RAMRUN_POLL);
+
+		ret = target_poll(target);
+		if (ret != ERROR_OK)
+			break;
+		if (target->state == TARGET_HALTED) {
+			LOG_ERROR("RAM image halted before posting a result");
+			return ERROR_FAIL;
+		}
+
+		ret = target_read_u32(target, mailbox, result);
+		if (ret != ERROR_OK || *result)
+			break;
+
+		if (timeval_ms() - start > timeout_ms) {
+			LOG_ERROR("no result from RAM image within %u ms", timeout_ms);
+			ret = ERROR_TARGET_TIMEOUT;
+			break;
+		}
+	}
+
+	LOG_INFO("RAM image ran %" PRId64 " ms", timeval_ms() - start);
+
+	ret2 = target_halt(target);
+	if (ret2 == ERROR_OK)
+		ret2 = target_wait_state(target, TARGET_HALTED, EFM32_ATTACH_HALT_TMO);
+	return ret != ERROR_OK ? ret : ret2;
+}
+
+COMMAND_HANDLER(efm32x_handle_ramrun_command)
+{
+	unsigned int timeout_ms = EFM32_RAMRUN_TMO;
+	uint32_t mailbox, vectors, result;
+	struct image image;
+
+	if (CMD_ARGC < 3 || CMD_ARGC > 5)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	COMMAND_PARSE_NUMBER(u32, CMD_ARGV[2], mailbox);
+	if (CMD_ARGC > 3)
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[3], timeout_ms);
+
+	struct target *target = bank->target;
+	if (target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t ram_end = EFM32_RAM_BASE + efm32x_info->info.ram_sz_kib * 1024;
+	if (mailbox < EFM32_RAM_BASE || mailbox + 4 > ram_end || (mailbox & 0x3)) {
+		command_print(CMD, "mailbox 0x%8.8" PRIx32 " is not a RAM word", mailbox);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	image.base_address_set = false;
+	image.base_address = 0;
+	image.start_address_set = false;
+	retval = image_open(&image, CMD_ARGV[1], CMD_ARGC > 4 ? CMD_ARGV[4] : NULL);
+	if (retval != ERROR_OK)
+		return retval;
+
+	/* a raw binary starts with its vector table at the start of RAM */
+	if (image.type == IMAGE_BINARY)
+		image.sections[0].base_address = EFM32_RAM_BASE;
+
+	retval = efm32x_ramrun_load(target, &image, ram_end, &vectors);
+	image_close(&image);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_ramrun(target, vectors, ram_end, mailbox, timeout_ms, &result);
+	if (retval != ERROR_OK)
+		return retval;
+
+	command_print(CMD, "0x%8.8" PRIx32, result);
+	return ERROR_OK;
+}
+
+static void efm32x_part_name(const struct efm32_info *info, char *name, size_t size)
+{
+	snprintf(name, size, "%cG%d%c%03d", info->part_family, info->part_family_num,
+		info->dev_num_letter, info->dev_num_digits);
+}
+
+COMMAND_HANDLER(efm32x_handle_ident_command)
+{
+	if (CMD_ARGC != 1)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct efm32_info *info = &efm32x_info->info;
+
+	char part[16];
+	efm32x_part_name(info, part, sizeof(part));
+
+	/* a Tcl dict, for scripts and the job queue in efm32s2.cfg */
+	command_print(CMD, "part %s rev %d eui64 %016" PRIx64
+		" flash_kib %d ram_kib %d page_size %d",
+		part, info->prod_rev, info->eui64,
+		info->flash_sz_kib, info->ram_sz_kib, info->page_size);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_journal_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1 && !strcmp(CMD_ARGV[1], "clear")) {
+		struct fileio *fileio;
+		if (!efm32x_info->journal_dir || !efm32x_info->info.eui64) {
+			command_print(CMD, "journal is off or the device is not probed");
+			return ERROR_FAIL;
+		}
+		char *path = efm32x_journal_path(efm32x_info);
+		retval = fileio_open(&fileio, path, FILEIO_WRITE, FILEIO_TEXT);
+		free(path);
+		if (retval != ERROR_OK)
+			return retval;
+		fileio_close(fileio);
+	} else if (CMD_ARGC > 1) {
+		free(efm32x_info->journal_dir);
+		efm32x_info->journal_dir = NULL;
+		if (strcmp(CMD_ARGV[1], "off"))
+			efm32x_info->journal_dir = strdup(CMD_ARGV[1]);
+	}
+
+	if (!efm32x_info->journal_dir) {
+		command_print(CMD, "journal off");
+	} else if (!efm32x_info->info.eui64) {
+		command_print(CMD, "journal in %s, device not probed yet", efm32x_info->journal_dir);
+	} else {
+		char *path = efm32x_journal_path(efm32x_info);
+		command_print(CMD, "journal %s", path);
+		free(path);
+	}
+
+	return ERROR_OK;
+}
+
+/* Read the sections of image that fall into bank into data, which holds the
+ * whole bank, and record the byte range covered in each page */
+static int efm32x_resume_load(struct flash_bank *bank, struct image *image,
+	uint8_t *data, struct efm32x_journal_page *want)
+{
+	for (unsigned int i = 0; i < image->num_sections; i++) {
+		target_addr_t start = image->sections[i].base_address;
+		target_addr_t end = start + image->sections[i].size;
+		size_t size_read;
+
+		if (start < bank->base)
+			start = bank->base;
+		if (end > bank->base + bank->size)
+			end = bank->base + bank->size;
+		if (start >= end)
+			continue;
+
+		int ret = image_read_section(image, i,
+			start - image->sections[i].base_address, end - start,
+			data + (start - bank->base), &size_read);
+		if (ret != ERROR_OK)
+			return ret;
+		if (size_read != end - start)
+			return ERROR_FAIL;
+
+		for (uint32_t offset = start - bank->base; offset < end - bank->base; ) {
+			unsigned int page = offset / bank->sectors[0].size;
+			uint32_t page_offset = bank->sectors[page].offset;
+			uint32_t page_end = page_offset + bank->sectors[page].size;
+			uint32_t n_end = end - bank->base < page_end ? end - bank->base : page_end;
+			/* writes start word aligned, the gap reads as erased */
+			uint32_t first = (offset - page_offset) & ~3;
+
+			if (want[page].state == EFM32_JOURNAL_NONE || first < want[page].start) {
+				if (want[page].state != EFM32_JOURNAL_NONE)
+					want[page].len += want[page].start - first;
+				want[page].start = first;
+				want[page].state = EFM32_JOURNAL_VERIFIED;
+			}
+			if (n_end - page_offset > want[page].start + want[page].len)
+				want[page].len = n_end - page_offset - want[page].start;
+			offset = n_end;
+		}
+	}
+
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_resume_command)
+{
+	struct efm32x_journal_page *have = NULL, *want = NULL;
+	uint8_t *data = NULL;
+	struct image image;
+	unsigned int n_skipped = 0, n_reverified = 0, n_programmed = 0;
+	bool continuing = false;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (!efm32x_info->journal_dir) {
+		command_print(CMD, "journal is off, enable it with 'efm32s2 journal'");
+		return ERROR_FAIL;
+	}
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	image.base_address_set = false;
+	image.base_address = 0;
+	image.start_address_set = false;
+	if (CMD_ARGC > 2) {
+		image.base_address_set = true;
+		COMMAND_PARSE_NUMBER(llong, CMD_ARGV[2], image.base_address);
+	}
+
+	retval = image_open(&image, CMD_ARGV[1], CMD_ARGC > 3 ? CMD_ARGV[3] : NULL);
+	if (retval != ERROR_OK)
+		return retval;
+
+	data = malloc(bank->size);
+	have = malloc(bank->num_sectors * sizeof(*have));
+	want = calloc(bank->num_sectors, sizeof(*want));
+	if (!data || !have || !want) {
+		LOG_ERROR("no memory for resume buffers");
+		retval = ERROR_FAIL;
+		goto cleanup;
+	}
+	memset(data, 0xff, bank->size);
+
+	retval = efm32x_resume_load(bank, &image, data, want);
+	if (retval == ERROR_OK)
+		retval = efm32x_journal_load(bank, have);
+	if (retval != ERROR_OK)
+		goto cleanup;
+
+	for (unsigned int page = 0; page < bank->num_sectors; page++) {
+		if (want[page].state == EFM32_JOURNAL_NONE)
+			continue;
+
+		uint32_t offset = bank->sectors[page].offset + want[page].start;
+		uint32_t len = want[page].len;
+		retval = image_calculate_checksum(data + offset, len, &want[page].crc);
+		if (retval != ERROR_OK)
+			goto cleanup;
+
+		if (have[page].state == EFM32_JOURNAL_VERIFIED && have[page].start == want[page].start
+				&& have[page].len == len && have[page].crc == want[page].crc) {
+			n_skipped++;
+			continue;
+		}
+
+		/* only the page in flight when the link dropped needs a look,
+		 * everything after it is programmed straight away */
+		if (!continuing && have[page].state != EFM32_JOURNAL_NONE) {
+			uint32_t crc;
+			retval = target_checksum_memory(bank->target, bank->base + offset, len, &crc);
+			if (retval != ERROR_OK)
+				goto cleanup;
+			if (crc == want[page].crc) {
+				efm32x_journal_record(bank, page, EFM32_JOURNAL_VERIFIED,
+					want[page].start, len, crc);
+				n_reverified++;
+				continue;
+			}
+		}
+
+		continuing = true;
+		retval = efm32x_erase(bank, page, page);
+		if (retval == ERROR_OK)
+			retval = efm32x_write(bank, data + offset, offset, len);
+		if (retval != ERROR_OK)
+			goto cleanup;
+		n_programmed++;
+		keep_alive();
+	}
+
+	command_print(CMD, "resume: %u pages verified before, %u re-verified, %u programmed",
+		n_skipped, n_reverified, n_programmed);
+
+cleanup:
+	free(want);
+	free(have);
+	free(data);
+	image_close(&image);
+	return retval;
+}
+
+static void efm32x_print_stats(struct efm32x_flash_chip *efm32x_info,
+	struct command_invocation *cmd)
+{
+	command_print(cmd, "%-14s %6s %9s %7s %10s %10s", "operation", "calls",
+		"total ms", "max ms", "reg/call", "algo/call");
+
+	for (int op = 0; op < EFM32_N_OPS; op++) {
+		const struct efm32x_op_stats *stats = &efm32x_info->stats[op];
+		if (!stats->calls)
+			continue;
+		command_print(cmd, "%-14s %6u %9" PRId64 " %7" PRId64 " %10" PRIu64 " %10" PRIu64,
+			efm32x_op_names[op], stats->calls, stats->total_ms, stats->max_ms,
+			stats->reg_accesses / stats->calls, stats->algo_runs / stats->calls);
+	}
+}
+
+COMMAND_HANDLER(efm32x_handle_stats_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1) {
+		if (strcmp(CMD_ARGV[1], "reset"))
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		memset(efm32x_info->stats, 0, sizeof(efm32x_info->stats));
+		memset(efm32x_info->saved, 0, sizeof(efm32x_info->saved));
+		return ERROR_OK;
+	}
+
+	efm32x_print_stats(efm32x_info, CMD);
+	return ERROR_OK;
+}
+
+/*
+ * Time each driver operation on a scratch page of the real device, through
+ * the same entry points the flash commands use. There is no simulated
+ * target: the figures include the adapter and its link.
+ */
+COMMAND_HANDLER(efm32x_handle_bench_command)
+{
+	unsigned int page, iterations = 1;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	COMMAND_PARSE_NUMBER(uint, CMD_ARGV[1], page);
+	if (CMD_ARGC > 2)
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[2], iterations);
+
+	if (page >= bank->num_sectors || bank->base == EFM32_MSC_LOCK_BITS) {
+		command_print(CMD, "no scratch page %u in flash bank %u", page, bank->bank_number);
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	if (bank->target->state != TARGET_HALTED) {
+		LOG_ERROR("Target not halted");
+		return ERROR_TARGET_NOT_HALTED;
+	}
+
+	if (efm32x_bg_busy(bank))
+		return ERROR_FLASH_BUSY;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	uint32_t size = bank->sectors[page].size;
+	uint8_t *pattern = malloc(size);
+	if (!pattern) {
+		LOG_ERROR("no memory for bench pattern");
+		return ERROR_FAIL;
+	}
+	for (uint32_t i = 0; i < size; i += 4)
+		h_u32_to_le(pattern + i, i ^ 0x5a5a5a5a);
+
+	memset(efm32x_info->stats, 0, sizeof(efm32x_info->stats));
+	memset(efm32x_info->saved, 0, sizeof(efm32x_info->saved));
+
+	for (unsigned int i = 0; retval == ERROR_OK && i < iterations; i++) {
+		retval = efm32x_probe(bank);
+		if (retval == ERROR_OK)
+			retval = efm32x_protect_check(bank);
+		if (retval == ERROR_OK)
+			retval = efm32x_erase(bank, page, page);
+		if (retval == ERROR_OK)
+			retval = efm32x_write(bank, pattern, bank->sectors[page].offset, size);
+		if (retval == ERROR_OK)
+			retval = efm32x_erase(bank, page, page);
+		if (retval == ERROR_OK) {
+			efm32x_info->force_word_write = true;
+			retval = efm32x_write(bank, pattern, bank->sectors[page].offset, size);
+			efm32x_info->force_word_write = false;
+		}
+		keep_alive();
+	}
+
+	free(pattern);
+	if (retval != ERROR_OK)
+		return retval;
+
+	efm32x_print_stats(efm32x_info, CMD);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_trace_command)
+{
+	unsigned int count = EFM32_TRACE_LEN;
+
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1) {
+		if (!strcmp(CMD_ARGV[1], "clear")) {
+			efm32x_info->trace_count = 0;
+			return ERROR_OK;
+		}
+		COMMAND_PARSE_NUMBER(uint, CMD_ARGV[1], count);
+	}
+
+	efm32x_trace_dump(efm32x_info, CMD, count);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_cache_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	int bank_index = efm32x_get_bank_index(bank->base);
+
+	if (CMD_ARGC > 1) {
+		if (!strcmp(CMD_ARGV[1], "flush")) {
+			struct efm32x_cache *cache = efm32x_info->cache[bank_index];
+			if (cache)
+				memset(cache->state, EFM32_CACHE_INVALID, cache->num_pages);
+		} else {
+			bool enable;
+			COMMAND_PARSE_ON_OFF(CMD_ARGV[1], enable);
+			if (!enable)
+				efm32x_cache_disable(bank);
+			else if (efm32x_cache_enable(bank) != ERROR_OK)
+				return ERROR_FAIL;
+		}
+	}
+
+	struct efm32x_cache *cache = efm32x_info->cache[bank_index];
+	if (!cache) {
+		command_print(CMD, "flash cache off");
+		return ERROR_OK;
+	}
+
+	unsigned int n_valid = 0, n_stale = 0;
+	for (unsigned int i = 0; i < cache->num_pages; i++) {
+		if (cache->state[i] == EFM32_CACHE_VALID)
+			n_valid++;
+		else if (cache->state[i] == EFM32_CACHE_STALE)
+			n_stale++;
+	}
+
+	command_print(CMD, "flash cache on, %u of %u pages valid, %u stale", n_valid,
+		cache->num_pages, n_stale);
+	command_print(CMD, "%" PRIu64 " page hits, %" PRIu64 " read, %" PRIu64 " revalidated",
+		cache->hits, cache->misses, cache->revalidated);
+	return ERROR_OK;
+}
+
+/*
+ * Append the stats gathered since the last save to a profile file, keyed by
+ * adapter and part, so saving twice in a session doesn't count ops twice
+ */
+static int efm32x_profile_save(struct efm32x_flash_chip *efm32x_info, const char *path)
+{
+	struct fileio *fileio;
+	char part[16];
+	int ret;
+
+	efm32x_part_name(&efm32x_info->info, part, sizeof(part));
+
+	ret = fileio_open(&fileio, path, FILEIO_APPEND, FILEIO_TEXT);
+	if (ret != ERROR_OK)
+		return ret;
+
+	for (int op = 0; ret == ERROR_OK && op < EFM32_N_OPS; op++) {
+		const struct efm32x_op_stats *stats = &efm32x_info->stats[op];
+		struct efm32x_op_stats *saved = &efm32x_info->saved[op];
+		size_t written;
+
+		if (stats->calls == saved->calls)
+			continue;
+
+		char *line = alloc_printf("%s %s %s %u %" PRIu64 " %" PRId64 " %" PRIu64 " %" PRIu64 "\n",
+			efm32x_adapter_name(), part, efm32x_op_names[op], stats->calls - saved->calls,
+			stats->units - saved->units, stats->total_ms - saved->total_ms,
+			stats->reg_accesses - saved->reg_accesses, stats->algo_runs - saved->algo_runs);
+		if (!line) {
+			ret = ERROR_FAIL;
+			break;
+		}
+		ret = fileio_write(fileio, strlen(line), line, &written);
+		if (ret == ERROR_OK && written != strlen(line))
+			ret = ERROR_FAIL;
+		free(line);
+		if (ret == ERROR_OK)
+			*saved = *stats;
+	}
+
+	fileio_close(fileio);
+	return ret;
+}
+
+/* Add the records of a profile file matching this adapter and part */
+static int efm32x_profile_load(struct efm32x_flash_chip *efm32x_info, const char *path)
+{
+	struct fileio *fileio;
+	char line[160], part[16];
+
+	efm32x_part_name(&efm32x_info->info, part, sizeof(part));
+
+	int ret = fileio_open(&fileio, path, FILEIO_READ, FILEIO_TEXT);
+	if (ret != ERROR_OK)
+		return ret;
+
+	while (fileio_fgets(fileio, sizeof(line), line) == ERROR_OK) {
+		char adapter[32], record_part[16], op_name[16];
+		struct efm32x_op_stats record;
+
+		if (sscanf(line, "%31s %15s %15s %u %" SCNu64 " %" SCNd64 " %" SCNu64 " %" SCNu64,
+				adapter, record_part, op_name, &record.calls, &record.units,
+				&record.total_ms, &record.reg_accesses, &record.algo_runs) != 8)
+			continue;
+		if (strcmp(adapter, efm32x_adapter_name()) || strcmp(record_part, part))
+			continue;
+
+		for (int op = 0; op < EFM32_N_OPS; op++) {
+			if (strcmp(op_name, efm32x_op_names[op]))
+				continue;
+			struct efm32x_op_stats *profile = &efm32x_info->profile[op];
+			profile->calls += record.calls;
+			profile->units += record.units;
+			profile->total_ms += record.total_ms;
+			profile->reg_accesses += record.reg_accesses;
+			profile->algo_runs += record.algo_runs;
+			efm32x_info->n_profile_records++;
+		}
+	}
+
+	fileio_close(fileio);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_profile_command)
+{
+	if (CMD_ARGC != 1 && CMD_ARGC != 3)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (CMD_ARGC == 3) {
+		if (!strcmp(CMD_ARGV[1], "save"))
+			return efm32x_profile_save(efm32x_info, CMD_ARGV[2]);
+		if (strcmp(CMD_ARGV[1], "load"))
+			return ERROR_COMMAND_SYNTAX_ERROR;
+		memset(efm32x_info->profile, 0, sizeof(efm32x_info->profile));
+		efm32x_info->n_profile_records = 0;
+		retval = efm32x_profile_load(efm32x_info, CMD_ARGV[2]);
+		if (retval != ERROR_OK)
+			return retval;
+	}
+
+	char part[16];
+	efm32x_part_name(&efm32x_info->info, part, sizeof(part));
+	command_print(CMD, "profile for %s on %s: %u records", part, efm32x_adapter_name(),
+		efm32x_info->n_profile_records);
+	for (int op = 0; op < EFM32_N_OPS; op++) {
+		const struct efm32x_op_stats *profile = &efm32x_info->profile[op];
+		if (profile->calls)
+			command_print(CMD, "%-14s %6u calls %10" PRIu64 " units %9" PRId64 " ms",
+				efm32x_op_names[op], profile->calls, profile->units, profile->total_ms);
+	}
+	return ERROR_OK;
+}
+
+/* FIFO size efm32x_write_block would get from the work area, 0 if none */
+static uint32_t efm32x_fifo_size(struct flash_bank *bank,
+	const struct efm32x_loader_variant *loader)
+{
+	struct target *target = bank->target;
+	struct working_area *code, *fifo;
+	uint32_t size = EFM32_FIFO_SIZE;
+
+	if (target_alloc_working_area(target, loader->code_size, &code) != ERROR_OK)
+		return 0;
+
+	while (target_alloc_working_area_try(target, size, &fifo) != ERROR_OK) {
+		size /= 2;
+		size &= ~3UL;
+		if (size <= 256) {
+			target_free_working_area(target, code);
+			return 0;
+		}
+	}
+
+	target_free_working_area(target, fifo);
+	target_free_working_area(target, code);
+	return size;
+}
+
+/* Show what write_image would do with an image and estimate its cost */
+COMMAND_HANDLER(efm32x_handle_plan_command)
+{
+	struct image image;
+	struct efm32x_image_runs ir;
+
+	if (CMD_ARGC < 2 || CMD_ARGC > 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	image.base_address_set = false;
+	image.base_address = 0;
+	image.start_address_set = false;
+	if (CMD_ARGC > 2) {
+		image.base_address_set = true;
+		COMMAND_PARSE_NUMBER(llong, CMD_ARGV[2], image.base_address);
+	}
+
+	retval = image_open(&image, CMD_ARGV[1], CMD_ARGC > 3 ? CMD_ARGV[3] : NULL);
+	if (retval != ERROR_OK)
+		return retval;
+
+	retval = efm32x_load_image_runs(bank, &image, &ir);
+	image_close(&image);
+	if (retval != ERROR_OK)
+		return retval;
+
+	unsigned int n_erase = 0;
+	for (unsigned int i = 0; i < ir.n_runs; i++) {
+		unsigned int first, last;
+		efm32x_run_pages(bank, ir.runs, i, &first, &last);
+		if (first <= last)
+			n_erase += last - first + 1;
+	}
+
+	command_print(CMD, "image %s: %u sections, %u runs, %" PRIu32 " bytes", CMD_ARGV[1],
+		ir.n_sections, ir.n_runs, ir.n_bytes);
+	command_print(CMD, "erase %u pages, skip %u pages", n_erase, bank->num_sectors - n_erase);
+
+	/* pages write_image would leave out, if the manifest was checked already */
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	const struct efm32x_manifest *manifest = efm32x_info->manifest;
+	if (manifest && manifest->checked && efm32x_get_bank_index(bank->base) == EFM32_BANK_INDEX_MAIN) {
+		uint32_t page_size = bank->sectors[0].size;
+		unsigned int n_current = 0;
+		for (unsigned int i = 0; i < ir.n_runs; i++) {
+			unsigned int first, last;
+			efm32x_run_pages(bank, ir.runs, i, &first, &last);
+			for (unsigned int page = first; page <= last; page++) {
+				uint32_t crc, old;
+				if (image_calculate_checksum(ir.data + page * page_size, page_size, &crc) == ERROR_OK
+						&& efm32x_manifest_lookup(manifest, bank->base + page * page_size, &old)
+						&& old == crc)
+					n_current++;
+			}
+		}
+		command_print(CMD, "%u of them up to date according to the page manifest", n_current);
+	}
+
+	const struct efm32x_loader_variant *loader = efm32x_pick_loader(bank, EFM32_LOADER_SCATTER);
+	uint32_t fifo_size = loader ? efm32x_fifo_size(bank, loader) : 0;
+	if (fifo_size)
+		command_print(CMD, "loader %s, FIFO %" PRIu32 " bytes, 1 algorithm run",
+			loader->name, fifo_size);
+	else
+		command_print(CMD, "no write loader or work area, word by word writes");
+
+	/* earlier sessions and this one */
+	struct efm32x_op_stats total[EFM32_N_OPS];
+	for (int op = 0; op < EFM32_N_OPS; op++) {
+		total[op] = efm32x_info->profile[op];
+		total[op].units += efm32x_info->stats[op].units;
+		total[op].total_ms += efm32x_info->stats[op].total_ms;
+		total[op].reg_accesses += efm32x_info->stats[op].reg_accesses;
+		total[op].calls += efm32x_info->stats[op].calls;
+	}
+
+	const struct efm32x_op_stats *erase = &total[EFM32_OP_ERASE];
+	const struct efm32x_op_stats *write = &total[fifo_size ? EFM32_OP_WRITE : EFM32_OP_WRITE_WORD];
+	uint64_t stream_words = ir.n_bytes / 4 + (fifo_size ? 2 * ir.n_runs : 0);
+	/* one AP write per word, plus the MSC register traffic around it */
+	double transactions = stream_words;
+
+	if (fifo_size)
+		transactions += EFM32_ALGO_TRANSACTIONS;
+	if (erase->units)
+		transactions += (double)erase->reg_accesses * n_erase / erase->units;
+	if (write->calls)
+		transactions += (double)write->reg_accesses / write->calls;
+
+	if (!erase->units || !write->units) {
+		command_print(CMD, "estimate: %.0f SWD transactions, no timing profile for %s "
+			"(run 'efm32s2 bench' or 'efm32s2 profile load')", transactions,
+			!erase->units ? "erase" : efm32x_op_names[write - total]);
+	} else {
+		double erase_ms = (double)erase->total_ms * n_erase / erase->units;
+		double write_ms = (double)write->total_ms * ir.n_bytes / write->units;
+		command_print(CMD, "estimate: %.0f SWD transactions, %.0f ms (erase %.0f ms, "
+			"program %.0f ms)", transactions, erase_ms + write_ms, erase_ms, write_ms);
+	}
+
+	efm32x_free_image_runs(&ir);
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_manifest_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 4)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (efm32x_get_bank_index(bank->base) != EFM32_BANK_INDEX_MAIN) {
+		command_print(CMD, "the page manifest is kept for the main flash bank only");
+		return ERROR_COMMAND_ARGUMENT_INVALID;
+	}
+
+	if (CMD_ARGC == 1) {
+		uint32_t addr = efm32x_manifest_location(bank);
+		const struct efm32x_manifest *manifest = NULL;
+		if (addr && efm32x_info->probed[EFM32_BANK_INDEX_MAIN])
+			manifest = efm32x_manifest_get(bank);
+
+		if (!addr) {
+			command_print(CMD, "page manifest off");
+		} else if (!manifest) {
+			command_print(CMD, "no valid page manifest at 0x%8.8" PRIx32, addr);
+		} else {
+			uint32_t first = (manifest->base - bank->base) / manifest->page_size;
+			command_print(CMD, "page manifest at 0x%8.8" PRIx32 ": image 0x%8.8" PRIx32
+				", pages %" PRIu32 " to %" PRIu32 ", %s", addr, manifest->image_id,
+				first, first + manifest->n_pages - 1,
+				manifest->checked ? "spot checked" : "not checked yet");
+		}
+		return ERROR_OK;
+	}
+
+	if (!strcmp(CMD_ARGV[1], "write")) {
+		unsigned int first = 0, count;
+
+		if (!efm32x_info->probed[EFM32_BANK_INDEX_MAIN]) {
+			command_print(CMD, "flash bank %u not probed", bank->bank_number);
+			return ERROR_FLASH_BANK_NOT_PROBED;
+		}
+		if (!efm32x_manifest_location(bank)) {
+			command_print(CMD, "no page manifest location set");
+			return ERROR_FAIL;
+		}
+		if (CMD_ARGC > 2)
+			COMMAND_PARSE_NUMBER(uint, CMD_ARGV[2], first);
+		count = bank->num_sectors - first;
+		if (CMD_ARGC > 3)
+			COMMAND_PARSE_NUMBER(uint, CMD_ARGV[3], count);
+		if (first >= bank->num_sectors || count == 0 || count > bank->num_sectors - first) {
+			command_print(CMD, "pages out of range");
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+
+		if (bank->target->state != TARGET_HALTED) {
+			LOG_ERROR("Target not halted");
+			return ERROR_TARGET_NOT_HALTED;
+		}
+
+		if (efm32x_bg_busy(bank))
+			return ERROR_FLASH_BUSY;
+
+		uint32_t *crc = malloc(count * sizeof(*crc));
+		if (!crc) {
+			LOG_ERROR("no memory for page CRCs");
+			return ERROR_FAIL;
+		}
+		for (unsigned int i = 0; retval == ERROR_OK && i < count; i++)
+			retval = target_checksum_memory(bank->target,
+				bank->base + bank->sectors[first + i].offset,
+				bank->sectors[first + i].size, &crc[i]);
+		if (retval == ERROR_OK)
+			retval = efm32x_manifest_write(bank, bank->base + bank->sectors[first].offset,
+				count, crc);
+		free(crc);
+		return retval;
+	}
+
+	if (CMD_ARGC != 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	if (!strcmp(CMD_ARGV[1], "off")) {
+		efm32x_info->manifest_loc = 0;
+	} else if (!strcmp(CMD_ARGV[1], "userdata")) {
+		efm32x_info->manifest_loc = EFM32_MANIFEST_USER_DATA;
+	} else {
+		uint32_t addr;
+		COMMAND_PARSE_NUMBER(u32, CMD_ARGV[1], addr);
+		if (addr == 0 || (addr & 0x3) || (addr >= EFM32_MSC_USER_DATA
+				&& addr < EFM32_MSC_USER_DATA + EFM32_USER_DATA_SZ)) {
+			command_print(CMD, "invalid page manifest location 0x%8.8" PRIx32, addr);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+		efm32x_info->manifest_loc = addr;
+	}
+
+	/* read from the new location by the next flash operation using it */
+	efm32x_manifest_free(efm32x_info);
+	efm32x_info->manifest_loaded = false;
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_erase_free_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], efm32x_info->erase_free);
+
+	command_print(CMD, "erase-free page updates %s", efm32x_info->erase_free ? "on" : "off");
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_verify_write_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+	if (CMD_ARGC > 1)
+		COMMAND_PARSE_ON_OFF(CMD_ARGV[1], efm32x_info->verify_write);
+
+	command_print(CMD, "verify while writing %s", efm32x_info->verify_write ? "on" : "off");
+	return ERROR_OK;
+}
+
+COMMAND_HANDLER(efm32x_handle_loader_command)
+{
+	if (CMD_ARGC < 1 || CMD_ARGC > 2)
+		return ERROR_COMMAND_SYNTAX_ERROR;
+
+	struct flash_bank *bank;
+	int retval = CALL_COMMAND_HANDLER(flash_command_get_bank, 0, &bank);
+	if (retval != ERROR_OK)
+		return retval;
+
+	struct efm32x_flash_chip *efm32x_info = bank->driver_priv;
+
+	if (CMD_ARGC > 1) {
+		bool found = !strcmp(CMD_ARGV[1], "auto");
+		for (size_t i = 0; i < ARRAY_SIZE(efm32x_write_loaders); i++)
+			found |= !strcmp(CMD_ARGV[1], efm32x_write_loaders[i].name);
+		if (!found) {
+			command_print(CMD, "unknown loader variant %s", CMD_ARGV[1]);
+			return ERROR_COMMAND_ARGUMENT_INVALID;
+		}
+
+		free(efm32x_info->loader_name);
+		efm32x_info->loader_name = NULL;
+		if (strcmp(CMD_ARGV[1], "auto"))
+			efm32x_info->loader_name = strdup(CMD_ARGV[1]);
+	}
+
+	const struct efm32x_loader_variant *loader = efm32x_pick_loader(bank, 0);
+	for (size_t i = 0; i < ARRAY_SIZE(efm32x_write_loaders); i++)
+		command_print(CMD, "%c %s (%" PRIu32 " bytes)",
+			loader == &efm32x_write_loaders[i] ? '*' : ' ',
+			efm32x_write_loaders[i].name, efm32x_write_loaders[i].code_size);
+
+	return ERROR_OK;
+}
+
+static const struct command_registration efm32x_exec_command_handlers[] = {
+	{
+		.name = "debuglock",
+		.handler = efm32x_handle_debuglock_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id",
+		.help = "Lock the debug interface of the device.",
+	},
+	{
+		.name = "finalize",
+		.handler = efm32x_handle_finalize_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id [userdata filename [offset]] "
+			"['lock' first_page last_page]... ['debuglock']",
+		.help = "Write user data, lock pages and lock debug access with "
+			"as few erases as possible, then check all of it once.",
+	},
+	{
+		.name = "attach",
+		.handler = efm32x_handle_attach_command,
+		.mode = COMMAND_EXEC,
+		.usage = "[retries]",
+		.help = "Halt the core of a sleeping device by examine, "
+			"connect-under-reset or DCI-assisted reset, whichever works first.",
+	},
+	{
+		.name = "ident",
+		.handler = efm32x_handle_ident_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id",
+		.help = "Print part, revision, EUI64, flash, RAM and page size "
+			"of the device as a Tcl dict.",
+	},
+	{
+		.name = "verify_write",
+		.handler = efm32x_handle_verify_write_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Read back and CRC each word as it is written (off by default).",
+	},
+	{
+		.name = "stats",
+		.handler = efm32x_handle_stats_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['reset']",
+		.help = "Print calls, time, MSC register accesses and algorithm "
+			"runs per driver operation.",
+	},
+	{
+		.name = "bench",
+		.handler = efm32x_handle_bench_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id scratch_page [iterations]",
+		.help = "Probe, check protection, erase and program the scratch page "
+			"with block and word writes, then print the statistics.",
+	},
+	{
+		.name = "trace",
+		.handler = efm32x_handle_trace_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id [count|'clear']",
+		.help = "Print the last flash driver events with their time "
+			"deltas and register values.",
+	},
+	{
+		.name = "cache",
+		.handler = efm32x_handle_cache_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off'|'flush']",
+		.help = "Keep a host copy of the flash contents to serve repeated "
+			"reads, and show how it is used.",
+	},
+	{
+		.name = "profile",
+		.handler = efm32x_handle_profile_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id [('save'|'load') filename]",
+		.help = "Append this session's operation stats to a timing profile, "
+			"or load the records matching this adapter and part.",
+	},
+	{
+		.name = "plan",
+		.handler = efm32x_handle_plan_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset [type]]",
+		.help = "Show the pages, runs and loader write_image would use for "
+			"an image and estimate its SWD transactions and time.",
+	},
+	{
+		.name = "manifest",
+		.handler = efm32x_handle_manifest_command,
+		.mode = COMMAND_ANY,
+		.usage = "bank_id [off|userdata|address|write [first_page [count]]]",
+		.help = "Set where the page CRC manifest of the last programmed image "
+			"is kept (off, userdata or a page of its own), show it, "
+			"or write it for pages already in flash.",
+	},
+	{
+		.name = "erase_free",
+		.handler = efm32x_handle_erase_free_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Program pages in place without erasing them when the "
+			"update only clears bits.",
+	},
+	{
+		.name = "loader",
+		.handler = efm32x_handle_loader_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['auto'|variant]",
+		.help = "List write loader variants, or force one of them.",
+	},
+	{
+		.name = "clock_boost",
+		.handler = efm32x_handle_clock_boost_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id ['on'|'off']",
+		.help = "Run flash algorithms at the fastest core clock of the part.",
+	},
+	{
+		.name = "bg_write",
+		.handler = efm32x_handle_bg_write_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset]",
+		.help = "Start programming a binary file page by page in the background.",
+	},
+	{
+		.name = "bg_status",
+		.handler = efm32x_handle_bg_status_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id",
+		.help = "Print state, bytes done, bytes total, current page and "
+			"rate in bytes/s of the background write.",
+	},
+	{
+		.name = "bg_cancel",
+		.handler = efm32x_handle_bg_cancel_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id",
+		.help = "Cancel the background write after the current page.",
+	},
+	{
+		.name = "bg_event",
+		.handler = efm32x_handle_bg_event_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id [tcl_command]",
+		.help = "Set the Tcl command invoked with event, bytes done, bytes total, "
+			"page and rate as background write progresses.",
+	},
+	{
+		.name = "journal",
+		.handler = efm32x_handle_journal_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id [directory|'off'|'clear']",
+		.help = "Journal erased, programmed and verified pages per device "
+			"into a file in directory.",
+	},
+	{
+		.name = "resume",
+		.handler = efm32x_handle_resume_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset [file_type]]",
+		.help = "Continue an interrupted write of an image, skipping the "
+			"pages the journal has as verified.",
+	},
+	{
+		.name = "write_file",
+		.handler = efm32x_handle_write_file_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset]",
+		.help = "Erase and program a binary file in one pass, streaming it "
+			"from a memory mapping.",
+	},
+	{
+		.name = "ramrun",
+		.handler = efm32x_handle_ramrun_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename mailbox [timeout_ms [type]]",
+		.help = "Load an image into RAM, run it and return the non-zero "
+			"result it posts to the mailbox word.",
+	},
+	{
+		.name = "write_image",
+		.handler = efm32x_handle_write_image_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset [type]]",
+		.help = "Erase the pages an image touches and program all of its "
+			"sections with a single loader run.",
+	},
+	{
+		.name = "pack",
+		.handler = efm32x_handle_pack_command,
+		.mode = COMMAND_ANY,
+		.usage = "package_file image_file part_family page_size flash_kib "
+			"[offset [file_type]]",
+		.help = "Build a flash package from an image, for parts of the given "
+			"family number, page size and flash size.",
+	},
+	{
+		.name = "write_package",
+		.handler = efm32x_handle_write_package_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id package_file ['force']",
+		.help = "Program a flash package, skipping pages whose CRC already "
+			"matches unless forced.",
+	},
+	{
+		.name = "snapshot",
+		.handler = efm32x_handle_snapshot_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename",
+		.help = "Read the bank back through a compressing loader and save "
+			"it as a snapshot file.",
+	},
+	{
+		.name = "restore",
+		.handler = efm32x_handle_restore_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename ['force']",
+		.help = "Program a snapshot back, skipping pages whose CRC already "
+			"matches unless forced.",
+	},
+	{
+		.name = "verify_pages",
+		.handler = efm32x_handle_verify_pages_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename [offset]",
+		.help = "Compare a binary file with flash by checksums over halving "
+			"ranges and list the pages that differ.",
+	},
+	{
+		.name = "delta_write",
+		.handler = efm32x_handle_delta_write_command,
+		.mode = COMMAND_EXEC,
+		.usage = "bank_id filename reference_filename [offset]",
+		.help = "Program a binary file, transferring only its difference "
+			"to the reference file assumed to be in flash.",
 	},
 	COMMAND_REGISTRATION_DONE
 };
@@ -1307,7 +7636,8 @@ const struct flash_driver efm32s2_flash = {
 	.erase = efm32x_erase,
 	.protect = efm32x_protect,
 	.write = efm32x_write,
-	.read = default_flash_read,
+	.read = efm32x_read,
+	.verify = efm32x_verify,
 	.probe = efm32x_probe,
 	.auto_probe = efm32x_auto_probe,
 	.erase_check = default_flash_blank_check,
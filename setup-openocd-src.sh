@@ -31,6 +31,8 @@ cmd git submodule -q update
 msg copying efm32s2 files to the OpenOCD source tree
 cmd cp ../efm32s2/efm32s2.c src/flash/nor/
 cmd cp ../efm32s2/efm32s2.cfg tcl/target/
+cmd mkdir -p contrib/loaders/flash/efm32s2
+cmd cp ../efm32s2/loaders/* contrib/loaders/flash/efm32s2/
 cmd patch -p1 -i ../efm32s2/adjust_openocd.patch
 
 
@@ -0,0 +1,9 @@
+@call .\_iface.bat
+@.\bin\openocd-efm32s2 -s scripts -f interface\%iface%.cfg ^
+	-c "transport select swd" ^
+	-f target\efm32s2.cfg ^
+	-c "tcl_port 6666" ^
+	-c "telnet_port 4444" ^
+	-c init
+
+pause